@@ -1,15 +1,20 @@
 #include "./dpf/dpf.h"
 #include "datastore.h"
+#include "util/memstats.h"
 #include "util/profiler.h"
+#include <algorithm>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <fcntl.h>
 #include <iostream>
 #include <map>
 #include <omp.h>
 #include <random>
+#include <stdexcept>
 #include <string>
+#include <unistd.h>
 #include <vector>
 
 #define SIZE_GB (1024 * 1024 * 1024)
@@ -35,15 +40,16 @@ void setup_database(datastore &store, size_t num_elements) {
   }
 }
 
-void run_single_query_vectorized(datastore &store, size_t N, size_t reps) {
+void run_single_query_vectorized(datastore &store, size_t N, size_t reps,
+                                 size_t threads) {
     profiler.start("DPF.KeyGen");
-    auto keys = DPF::Gen(5, N);
+    auto keys = DPF::Gen(5, N, 0, DPF::Scheme::GGM, store.size());
     profiler.accumulate("DPF.KeyGen");
 
-    auto key = keys.first;
+    DPF::Key key(keys.first);
 
     profiler.start("DPF.Eval");
-    auto query = DPF::EvalFull8(key, N);
+    auto query = DPF::EvalFullParallel(key, N, threads);
     profiler.accumulate("DPF.Eval");
 
     profiler.start("PIR.CPU");
@@ -57,10 +63,10 @@ void run_single_query_vectorized(datastore &store, size_t N, size_t reps) {
 void run_single_query_scalar(datastore &store, size_t N, size_t reps) {
   for (size_t i = 0; i < reps; ++i) {
     profiler.start("DPF.KeyGen");
-    auto keys = DPF::Gen(5, N);
+    auto keys = DPF::Gen(5, N, 0, DPF::Scheme::GGM, store.size());
     profiler.accumulate("DPF.KeyGen");
 
-    auto key = keys.first;
+    DPF::Key key(keys.first);
 
     profiler.start("DPF.Eval");
     auto query = DPF::EvalFull(key, N);
@@ -109,63 +115,426 @@ void run_single_query_scalar(datastore &store, size_t N, size_t reps) {
 //   profiler.reset();
 // }
 
+// One server's keys for batch_size queries of records drawn uniformly from
+// the store, parsed once up front.
+static std::vector<DPF::Key> batch_keys(const datastore &store, size_t N,
+                                        size_t batch_size) {
+  std::vector<DPF::Key> keys;
+  std::mt19937 rng(std::random_device{}());
+  std::uniform_int_distribution<size_t> dist(0, store.size() - 1);
+  for (size_t i = 0; i < batch_size; ++i)
+    keys.emplace_back(
+        DPF::Gen(dist(rng), N, 0, DPF::Scheme::GGM, store.size()).first);
+  return keys;
+}
+
 void run_batch_query8(datastore &store, size_t N, size_t batch_size,
                       size_t reps) {
   using db_record = datastore::db_record;
 
   // Step 1: Generate a batch of unique DPF keys
-  std::vector<std::vector<uint8_t>> keys(batch_size);
-  std::mt19937 rng(std::random_device{}());
-  std::uniform_int_distribution<size_t> dist(0, N - 1);
-
-  for (size_t i = 0; i < batch_size; ++i) {
-    size_t index = dist(rng);
-    auto key_pair = DPF::Gen(index, N);
-    keys[i] = key_pair.first;
-  }
+  std::vector<DPF::Key> keys = batch_keys(store, N, batch_size);
   cout << "Batch size: " << batch_size << endl;
 
   // Step 2: Allocate answers buffer
   std::vector<db_record, AlignmentAllocator<db_record, sizeof(db_record)>>
       answers(batch_size);
 
+  // One query buffer per thread, reused across the whole batch
+  std::vector<std::vector<uint8_t>> queries(omp_get_max_threads());
+  for (auto &q : queries)
+    q.resize(DPF::EvalFullSize(N));
+
   // Step 3: Run the benchmark
   std::string event_name = "Batch = " + std::to_string(batch_size);
+  MemStats mem_before = MemStats::now();
   profiler.start(event_name);
 
   for (size_t r = 0; r < reps; ++r) {
 #pragma omp parallel for
     for (size_t i = 0; i < batch_size; ++i) {
-      auto query = DPF::EvalFull8(keys[i], N);
+      auto &query = queries[omp_get_thread_num()];
+      DPF::EvalFull8Into(keys[i], N, query);
       answers[i] = store.answer_pir(query);
     }
     profiler.accumulate(event_name);
   }
+  MemStats mem = MemStats::now() - mem_before;
 
   double avg_ms = profiler.getAverageTime(event_name);
   double throughput = (batch_size * 1000.0) / avg_ms;
 
   std::cout << "Throughput : " << throughput
             << " DPFs/sec" << std::endl;
+  std::cout << "Per query:" << std::endl;
+  mem.print(std::cout, batch_size * reps);
 
   profiler.printAllTimes(true);
   profiler.reset();
 }
 
+// Same batch as run_batch_query8, but each query is answered by
+// datastore::answer_dpf, which never materialises the bitmap.
+void run_batch_query_fused(datastore &store, size_t N, size_t batch_size,
+                           size_t reps) {
+  using db_record = datastore::db_record;
+
+  std::vector<DPF::Key> keys = batch_keys(store, N, batch_size);
+  cout << "Batch size: " << batch_size << endl;
+
+  std::vector<db_record, AlignmentAllocator<db_record, sizeof(db_record)>>
+      answers(batch_size);
+
+  std::string event_name = "Batch = " + std::to_string(batch_size);
+  MemStats mem_before = MemStats::now();
+  profiler.start(event_name);
+
+  for (size_t r = 0; r < reps; ++r) {
+#pragma omp parallel for
+    for (size_t i = 0; i < batch_size; ++i) {
+      answers[i] = store.answer_dpf(keys[i], N);
+    }
+    profiler.accumulate(event_name);
+  }
+  MemStats mem = MemStats::now() - mem_before;
+
+  double avg_ms = profiler.getAverageTime(event_name);
+  double throughput = (batch_size * 1000.0) / avg_ms;
+
+  std::cout << "Throughput : " << throughput
+            << " DPFs/sec" << std::endl;
+  std::cout << "Per query:" << std::endl;
+  mem.print(std::cout, batch_size * reps);
+
+  profiler.printAllTimes(true);
+  profiler.reset();
+}
+
+// Per-core GB/s of the answer_pir scan kernels, AVX2 against AVX-512:
+// once over the whole database (DRAM-bound) and repeatedly over its first
+// 8192 records (256 KiB, cache-resident), where the kernel itself limits.
+void run_scan_kernels(datastore &store, size_t N, size_t reps) {
+  auto keys = DPF::Gen(5, N, 0, DPF::Scheme::GGM, store.size());
+  auto query = DPF::EvalFull(DPF::Key(keys.first), N);
+  const size_t hot = std::min(store.size(), (size_t)8192), hot_reps = 1000;
+  if (!datastore::HasAVX512())
+    cout << "AVX-512 not available, both rows use AVX2" << endl;
+  for (bool avx512 : {false, true}) {
+    datastore::SetAVX512(avx512);
+    const string name = avx512 ? "AVX-512" : "AVX2";
+    for (size_t r = 0; r < reps; r++) {
+      profiler.start(name + " DRAM");
+      store.answer_pir(query);
+      profiler.accumulate(name + " DRAM");
+      profiler.start(name + " cache");
+      for (size_t i = 0; i < hot_reps; i++)
+        store.answer_pir(query, hot);
+      profiler.accumulate(name + " cache");
+    }
+    const double dram = store.size() * sizeof(datastore::db_record) / 1e6 /
+                        profiler.getMedianTime(name + " DRAM");
+    const double cache = hot_reps * hot * sizeof(datastore::db_record) / 1e6 /
+                         profiler.getMedianTime(name + " cache");
+    printf("%-7s : DRAM %.2f GB/s, cache-resident %.2f GB/s\n", name.c_str(),
+           dram, cache);
+  }
+  datastore::SetAVX512(true);
+  profiler.reset();
+}
+
+// One server's bitmaps for `count` queries spread over the store's records,
+// expanded on all threads. For the scan benchmarks, which do not time this.
+template <typename Store>
+static std::vector<std::vector<uint8_t>>
+make_bitmaps(const Store &store, size_t logn, size_t count) {
+  std::vector<std::vector<uint8_t>> bitmaps(count);
+  for (size_t i = 0; i < count; ++i) {
+    auto key_pair = DPF::Gen((i * 2654435761ULL) % store.size(), logn, 0,
+                             DPF::Scheme::GGM, store.size());
+    bitmaps[i] = DPF::EvalFullParallel(DPF::Key(key_pair.first), logn);
+  }
+  return bitmaps;
+}
+
+// The scan half of a batch: one answer_pir per bitmap, each streaming the
+// whole database, against answer_pir_batch_tiled, which streams it once,
+// and its table-lookup variant. The bitmaps are expanded up front and not
+// timed.
+void run_batch_scan(datastore &store, size_t N, size_t batch_size,
+                    size_t reps, size_t threads) {
+  if (threads == 0)
+    threads = omp_get_max_threads();
+  auto bitmaps = make_bitmaps(store, N, batch_size);
+  cout << "Batch size: " << batch_size << endl;
+
+  datastore::aligned_vector answers(batch_size);
+  const string each = "PIR.CPU answer_pir x" + to_string(batch_size);
+  const string shared = "PIR.CPU answer_pir_batch_tiled";
+  const string table = "PIR.CPU answer_pir_batch_table";
+  for (size_t r = 0; r < reps; ++r) {
+    profiler.start(each);
+#pragma omp parallel for num_threads(threads)
+    for (size_t i = 0; i < batch_size; ++i)
+      answers[i] = store.answer_pir(bitmaps[i]);
+    profiler.accumulate(each);
+
+    profiler.start(shared);
+    store.answer_pir_batch_tiled(bitmaps, answers, threads);
+    profiler.accumulate(shared);
+
+    profiler.start(table);
+    store.answer_pir_batch_table(bitmaps, answers, threads);
+    profiler.accumulate(table);
+  }
+  for (const string &event : {each, shared, table})
+    printf("%s : %f ms, %.0f queries/s\n", event.c_str(),
+           profiler.getMedianTime(event),
+           batch_size * 1e3 / profiler.getMedianTime(event));
+  printf("scan sharing speedup %.2fx, table lookup %.2fx\n",
+         profiler.getMedianTime(each) / profiler.getMedianTime(shared),
+         profiler.getMedianTime(each) / profiler.getMedianTime(table));
+  profiler.reset();
+}
+
+// Per-query scan cost of the masked-XOR and table-lookup batch engines for
+// batch sizes 1..max_batch, to find where the 255-XOR table pays off.
+void run_table_crossover(datastore &store, size_t N, size_t max_batch,
+                         size_t reps, size_t threads) {
+  auto all = make_bitmaps(store, N, max_batch);
+  datastore::aligned_vector answers;
+  for (size_t b = 1; b <= max_batch; b *= 2) {
+    std::vector<std::vector<uint8_t>> bitmaps(all.begin(), all.begin() + b);
+    const string masked = "masked B=" + to_string(b);
+    const string table = "table B=" + to_string(b);
+    for (size_t r = 0; r < reps; ++r) {
+      profiler.start(masked);
+      store.answer_pir_batch_tiled(bitmaps, answers, threads);
+      profiler.accumulate(masked);
+      profiler.start(table);
+      store.answer_pir_batch_table(bitmaps, answers, threads);
+      profiler.accumulate(table);
+    }
+    const double m = profiler.getMedianTime(masked) / b;
+    const double t = profiler.getMedianTime(table) / b;
+    printf("B=%3zu : masked %8.3f ms/query, table %8.3f ms/query, table "
+           "speedup %.2fx\n",
+           b, m, t, m / t);
+  }
+  profiler.reset();
+}
+
+// STREAM Copy bandwidth in GB/s (bytes read + written) over two arrays of
+// `bytes`, on `threads` threads: the ceiling a record scan is held against.
+double stream_copy_gbs(size_t bytes, size_t threads, size_t reps) {
+  const size_t n = bytes / sizeof(datastore::db_record);
+  datastore::aligned_vector a(n), b(n, _mm256_set1_epi64x(1));
+  for (size_t r = 0; r <= reps; r++) {
+    if (r > 0) // the first pass faults the pages in
+      profiler.start("STREAM.Copy");
+#pragma omp parallel for schedule(static) num_threads(threads)
+    for (size_t i = 0; i < n; i++)
+      _mm256_stream_si256(&a[i], b[i]);
+    if (r > 0)
+      profiler.accumulate("STREAM.Copy");
+  }
+  return 2.0 * n * sizeof(datastore::db_record) / 1e6 /
+         profiler.getMedianTime("STREAM.Copy");
+}
+
+// answer_pir on one thread against answer_pir_parallel, as achieved read
+// bandwidth of the record scan next to the machine's STREAM Copy figure.
+void run_scan(datastore &store, size_t N, size_t reps, size_t threads) {
+  if (threads == 0)
+    threads = omp_get_max_threads();
+  auto keys = DPF::Gen(5, N, 0, DPF::Scheme::GGM, store.size());
+  auto query = DPF::EvalFullParallel(DPF::Key(keys.first), N, threads);
+  const double gb = store.size() * sizeof(datastore::db_record) / 1e9;
+  const string serial = "PIR.CPU 1 thread";
+  const string parallel = "PIR.CPU " + to_string(threads) + " threads";
+  for (size_t r = 0; r < reps; r++) {
+    profiler.start(serial);
+    store.answer_pir(query);
+    profiler.accumulate(serial);
+
+    profiler.start(parallel);
+    store.answer_pir_parallel(query, store.size(), threads);
+    profiler.accumulate(parallel);
+  }
+  const double stream = stream_copy_gbs(
+      std::min(store.size() * sizeof(datastore::db_record), (size_t)SIZE_GB),
+      threads, reps);
+  for (const string &event : {serial, parallel}) {
+    const double gbs = gb * 1e3 / profiler.getMedianTime(event);
+    printf("%s : %f ms, %.2f GB/s, %.0f%% of STREAM Copy (%.2f GB/s)\n",
+           event.c_str(), profiler.getMedianTime(event), gbs,
+           100 * gbs / stream, stream);
+  }
+  profiler.reset();
+}
+
+// answer_pir and answer_pir_batch on records of R bytes, 2^logn of them,
+// as GB/s of records scanned (batch bytes count once per bitmap). The
+// kernels loop over a record's lanes, so for the same database bytes the
+// figures should not fall as records widen.
+template <size_t R>
+void run_width(const basic_datastore<R> &store, size_t logn,
+               size_t batch_size, size_t reps, size_t threads) {
+  auto bitmaps = make_bitmaps(store, logn, batch_size);
+  typename basic_datastore<R>::aligned_vector answers;
+  const string single = to_string(R) + " B answer_pir";
+  const string batch = to_string(R) + " B answer_pir_batch";
+  for (size_t r = 0; r < reps; ++r) {
+    profiler.start(single);
+    store.answer_pir(bitmaps[0]);
+    profiler.accumulate(single);
+    profiler.start(batch);
+    store.answer_pir_batch(bitmaps, answers, threads);
+    profiler.accumulate(batch);
+  }
+  const double gb = store.size() * R / 1e6;
+  printf("%5zu B records : answer_pir %.2f GB/s, answer_pir_batch x%zu "
+         "%.2f GB/s\n",
+         R, gb / profiler.getMedianTime(single), batch_size,
+         batch_size * gb / profiler.getMedianTime(batch));
+  profiler.reset();
+}
+
+template <size_t R>
+void run_width(size_t logn, size_t batch_size, size_t reps, size_t threads) {
+  basic_datastore<R> store;
+  store.dummy(1ULL << logn);
+  run_width(store, logn, batch_size, reps, threads);
+}
+
+// Evicts a file from the page cache, so the next read comes from disk.
+static void drop_page_cache(const string &path) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+// Start-up time to the first answer: rebuilding the records in memory as
+// every run used to, against serving the file saved at `path` with
+// open_mmap, from a cold page cache and a warm one, per open_mmap flag
+// set. The query is expanded up front and not timed.
+void run_cold_start(const datastore &store, size_t N, const string &path,
+                    size_t reps) {
+  store.save(path);
+  auto keys = DPF::Gen(5, N, 0, DPF::Scheme::GGM, store.size());
+  auto query = DPF::EvalFull(DPF::Key(keys.first), N);
+  const string rebuild = "rebuild + answer";
+  for (size_t r = 0; r < reps; r++) {
+    profiler.start(rebuild);
+    datastore fresh;
+    fresh.reserve(store.size());
+    setup_database(fresh, store.size());
+    fresh.answer_pir(query);
+    profiler.accumulate(rebuild);
+  }
+  printf("%-40s : %10.3f ms\n", rebuild.c_str(),
+         profiler.getMedianTime(rebuild));
+
+  const std::pair<unsigned, string> configs[] = {
+      {0, "mmap"},
+      {datastore::kMapPopulate, "mmap populate"},
+      {datastore::kMapPopulate | datastore::kMapHugePages,
+       "mmap populate hugepages"}};
+  for (const auto &config : configs) {
+    for (bool cold : {true, false}) {
+      const string event = config.second + (cold ? " cold" : " warm");
+      for (size_t r = 0; r < reps; r++) {
+        if (cold)
+          drop_page_cache(path);
+        profiler.start(event);
+        datastore::open_mmap(path, config.first).answer_pir(query);
+        profiler.accumulate(event);
+      }
+      printf("%-40s : %10.3f ms\n", (event + " + answer").c_str(),
+             profiler.getMedianTime(event));
+    }
+  }
+  std::remove(path.c_str());
+  profiler.reset();
+}
+
+// The kB figure of a /proc/meminfo counter (a page count for
+// HugePages_*), 0 if it is absent.
+static size_t meminfo(const string &key) {
+  FILE *f = std::fopen("/proc/meminfo", "r");
+  char line[256];
+  size_t value = 0;
+  while (f && std::fgets(line, sizeof(line), f))
+    if (string(line).compare(0, key.size() + 1, key + ":") == 0)
+      value = std::strtoull(line + key.size() + 1, nullptr, 10);
+  if (f)
+    std::fclose(f);
+  return value;
+}
+
+// answer_pir GB/s over a copy of the records on the Pages policy, with
+// the bitmap on the same pages, and how much of the copy the kernel put
+// on huge pages (THP or the hugetlbfs pool).
+template <typename Pages>
+void run_pages(const datastore &store, size_t N, size_t reps,
+               const string &name) {
+  const size_t thp = meminfo("AnonHugePages");
+  const size_t pool = meminfo("HugePages_Free");
+  basic_datastore<32, Pages> copy;
+  copy.reserve(store.size());
+  for (size_t i = 0; i < store.size(); i++)
+    copy.push_back(store.data()[i]);
+  const double huge_mb =
+      ((double)meminfo("AnonHugePages") - thp +
+       ((double)pool - meminfo("HugePages_Free")) * meminfo("Hugepagesize")) /
+      1024;
+
+  DPF::Key key(DPF::Gen(5, N, 0, DPF::Scheme::GGM, store.size()).first);
+  typename basic_datastore<32, Pages>::bitmap_vector bits(
+      DPF::EvalFullSize(key, N));
+  DPF::EvalFullInto(key, N, span<uint8_t>(bits.data(), bits.size()));
+  for (size_t r = 0; r < reps; r++) {
+    profiler.start(name);
+    copy.answer_pir(bits);
+    profiler.accumulate(name);
+  }
+  const size_t bytes = store.size() * sizeof(datastore::db_record);
+  printf("%-14s : answer_pir %.2f GB/s, %.0f of %.0f MiB on huge pages\n",
+         name.c_str(), bytes / 1e6 / profiler.getMedianTime(name), huge_mb,
+         bytes / 1048576.0);
+  profiler.reset();
+}
+
+// k records: k keys, each answered by its own answer_dpf scan, against
+// the same keys answered together by answer_dpf_multi in a single pass.
+void run_multi_query(datastore &store, size_t N, size_t k, size_t reps) {
+  std::vector<DPF::Key> keys = batch_keys(store, N, k);
+  cout << "k = " << k << endl;
+
+  string scans = "PIR.CPU " + to_string(k) + " scans";
+  string one = "PIR.CPU one pass";
+  for (size_t r = 0; r < reps; r++) {
+    profiler.start(scans);
+    for (size_t i = 0; i < k; i++)
+      store.answer_dpf(keys[i], N);
+    profiler.accumulate(scans);
+
+    profiler.start(one);
+    store.answer_dpf_multi(keys, N);
+    profiler.accumulate(one);
+  }
+  profiler.printAllTimes(true);
+  profiler.reset();
+}
+
 void run_batch_query(datastore &store, size_t N, size_t batch_size,
                      size_t reps) {
   using db_record = datastore::db_record;
 
   // Step 1: Generate a batch of unique DPF keys
-  std::vector<std::vector<uint8_t>> keys(batch_size);
-  std::mt19937 rng(std::random_device{}());
-  std::uniform_int_distribution<size_t> dist(0, N - 1);
-
-  for (size_t i = 0; i < batch_size; ++i) {
-    size_t index = dist(rng);
-    auto key_pair = DPF::Gen(index, N);
-    keys[i] = key_pair.first;
-  }
+  std::vector<DPF::Key> keys = batch_keys(store, N, batch_size);
   cout << "Batch size: " << batch_size << endl;
 
   // Step 2: Allocate answers buffer
@@ -200,29 +569,69 @@ int main(int argc, char **argv) {
 
   if (!args.count("mode") || !args.count("logN")) {
     cerr << "Usage:\n"
-         << "  ./cpu_bench mode=single8 logN=24 reps=5\n"
+         << "  ./cpu_bench mode=single8 logN=24 reps=5 threads=32\n"
          << "  ./cpu_bench mode=single logN=24 reps=5\n"
          << "  ./cpu_bench mode=batch8 logN=25 batch=64 reps=10\n"
-         << "  ./cpu_bench mode=batch logN=25 batch=64 reps=10\n";
+         << "  ./cpu_bench mode=batch logN=25 batch=64 reps=10\n"
+         << "  ./cpu_bench mode=batch_fused logN=25 batch=64 reps=10\n"
+         << "  ./cpu_bench mode=multi logN=25 k=16 reps=10\n"
+         << "  ./cpu_bench mode=scan logN=25 reps=10 threads=32\n"
+         << "  ./cpu_bench mode=kernel logN=25 reps=10\n"
+         << "  ./cpu_bench mode=batch_scan logN=25 batch=64 reps=10\n"
+         << "  ./cpu_bench mode=crossover logN=24 batch=256 reps=5\n"
+         << "  ./cpu_bench mode=width logN=24 batch=16 reps=5\n"
+         << "  ./cpu_bench mode=coldstart logN=24 reps=3 file=/tmp/cpu_bench.db\n"
+         << "  ./cpu_bench mode=hugepages logN=25 reps=10\n"
+         << "  (records=R evaluates a truncated domain of R <= 2^logN records)\n"
+         << "  (db=FILE serves a file saved by datastore::save instead of\n"
+         << "   building the records; populate=1 and hugepages=1 set the\n"
+         << "   open_mmap flags)\n";
     return 1;
   }
 
   string mode = args["mode"];
   size_t N = stoul(args["logN"]);
   size_t reps = args.count("reps") ? stoul(args["reps"]) : 10;
-  size_t num_elements = 1ULL << N;
+  size_t threads = args.count("threads") ? stoul(args["threads"]) : 0;
+  size_t num_elements =
+      args.count("records") ? stoul(args["records"]) : 1ULL << N;
+  if (num_elements == 0 || num_elements > (1ULL << N)) {
+    cerr << "records must be in [1, 2^logN].\n";
+    return 1;
+  }
+
+  datastore store;
+  if (args.count("db")) {
+    unsigned flags = 0;
+    if (args.count("populate") && args["populate"] != "0")
+      flags |= datastore::kMapPopulate;
+    if (args.count("hugepages") && args["hugepages"] != "0")
+      flags |= datastore::kMapHugePages;
+    try {
+      store = datastore::open_mmap(args["db"], flags);
+    } catch (const std::runtime_error &e) {
+      cerr << e.what() << endl;
+      return 1;
+    }
+    num_elements = store.size();
+    if (num_elements == 0 || num_elements > (1ULL << N)) {
+      cerr << "db must hold between 1 and 2^logN records.\n";
+      return 1;
+    }
+  }
 
   double DB_size =
       static_cast<double>(num_elements * sizeof(datastore::db_record)) /
       SIZE_GB;
   cout << "Database Size: " << DB_size << " GB" << endl;
 
-  datastore store;
-  store.reserve(num_elements);
-  setup_database(store, num_elements);
+  if (!store.mapped()) {
+    store.reserve(num_elements);
+    setup_database(store, num_elements);
+  }
 
   if (mode == "single8") {
-    run_single_query_vectorized(store, N, reps);
+    run_single_query_vectorized(store, N, reps, threads);
   } else if (mode == "single") {
     run_single_query_scalar(store, N, reps);
   } else if (mode == "batch") {
@@ -239,6 +648,58 @@ int main(int argc, char **argv) {
     }
     size_t batch_size = stoul(args["batch"]);
     run_batch_query8(store, N, batch_size, reps);
+  } else if (mode == "batch_fused") {
+    if (!args.count("batch")) {
+      cerr << "Missing 'batch' parameter for batch mode.\n";
+      return 1;
+    }
+    size_t batch_size = stoul(args["batch"]);
+    run_batch_query_fused(store, N, batch_size, reps);
+  } else if (mode == "multi") {
+    size_t k = args.count("k") ? stoul(args["k"]) : 16;
+    if (k == 0) {
+      cerr << "k must be at least 1.\n";
+      return 1;
+    }
+    run_multi_query(store, N, k, reps);
+  } else if (mode == "batch_scan") {
+    size_t batch_size = args.count("batch") ? stoul(args["batch"]) : 64;
+    if (batch_size == 0) {
+      cerr << "batch must be at least 1.\n";
+      return 1;
+    }
+    run_batch_scan(store, N, batch_size, reps, threads);
+  } else if (mode == "crossover") {
+    size_t max_batch = args.count("batch") ? stoul(args["batch"]) : 256;
+    if (max_batch == 0) {
+      cerr << "batch must be at least 1.\n";
+      return 1;
+    }
+    run_table_crossover(store, N, max_batch, reps, threads);
+  } else if (mode == "width") {
+    size_t batch_size = args.count("batch") ? stoul(args["batch"]) : 16;
+    if (batch_size == 0 || N < 5) {
+      cerr << "width needs batch >= 1 and logN >= 5.\n";
+      return 1;
+    }
+    // the same database bytes in 32-byte to 1 KiB records
+    run_width(store, N, batch_size, reps, threads);
+    run_width<64>(N - 1, batch_size, reps, threads);
+    run_width<256>(N - 3, batch_size, reps, threads);
+    run_width<1024>(N - 5, batch_size, reps, threads);
+  } else if (mode == "hugepages") {
+    // base pages, then 2 MiB and 1 GiB huge pages
+    run_pages<DefaultPages>(store, N, reps, "4 KiB pages");
+    run_pages<HugePages<>>(store, N, reps, "2 MiB pages");
+    run_pages<HugePages<1ULL << 30>>(store, N, reps, "1 GiB pages");
+  } else if (mode == "coldstart") {
+    run_cold_start(store, N,
+                   args.count("file") ? args["file"] : "/tmp/cpu_bench.db",
+                   reps);
+  } else if (mode == "kernel") {
+    run_scan_kernels(store, N, reps);
+  } else if (mode == "scan") {
+    run_scan(store, N, reps, threads);
   } else {
     cerr << "Unknown mode: " << mode << endl;
     return 1;
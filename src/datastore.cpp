@@ -1,37 +1,606 @@
 #include "datastore.h"
+#include "dpf/dpf.h"
 
+#include <algorithm>
+#include <memory>
 #include <cassert>
+#include <cerrno>
 #include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <omp.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-datastore::db_record
-datastore::answer_pir(const std::vector<uint8_t> &indexing) const {
-  db_record result = _mm256_set_epi64x(0, 0, 0, 0);
-  db_record results[8] = {
-      {result}, {result}, {result}, {result},
-      {result}, {result}, {result}, {result},
-  };
-  assert(data_.size() % 8 == 0);
-
-  for (size_t i = 0; i < data_.size(); i += 8) {
-
-    uint64_t tmp = indexing[i / 8];
-    results[0] = _mm256_xor_si256(results[0],_mm256_and_si256(data_[i + 0], _mm256_set1_epi64x(-((tmp >> 0) & 1))));
-    results[1] = _mm256_xor_si256(results[1],_mm256_and_si256(data_[i + 1], _mm256_set1_epi64x(-((tmp >> 1) & 1))));
-    results[2] = _mm256_xor_si256(results[2],_mm256_and_si256(data_[i + 2], _mm256_set1_epi64x(-((tmp >> 2) & 1))));
-    results[3] = _mm256_xor_si256(results[3],_mm256_and_si256(data_[i + 3], _mm256_set1_epi64x(-((tmp >> 3) & 1))));
-    results[4] = _mm256_xor_si256(results[4],_mm256_and_si256(data_[i + 4], _mm256_set1_epi64x(-((tmp >> 4) & 1))));
-    results[5] = _mm256_xor_si256(results[5],_mm256_and_si256(data_[i + 5], _mm256_set1_epi64x(-((tmp >> 5) & 1))));
-    results[6] = _mm256_xor_si256(results[6],_mm256_and_si256(data_[i + 6], _mm256_set1_epi64x(-((tmp >> 6) & 1))));
-    results[7] = _mm256_xor_si256(results[7],_mm256_and_si256(data_[i + 7], _mm256_set1_epi64x(-((tmp >> 7) & 1))));
-
-  }
-
-  result = _mm256_xor_si256(results[0], results[1]);
-  result = _mm256_xor_si256(result, results[2]);
-  result = _mm256_xor_si256(result, results[3]);
-  result = _mm256_xor_si256(result, results[4]);
-  result = _mm256_xor_si256(result, results[5]);
-  result = _mm256_xor_si256(result, results[6]);
-  result = _mm256_xor_si256(result, results[7]);
+// The kernels see a record as L = RecordBytes / 32 consecutive __m256i
+// lanes: record i of data is data[L * i, L * i + L). An accumulator set
+// holds S = acc_slots(L) records; with one-lane records each record k of a
+// group gets its own slot, so the eight XOR chains are independent, while
+// wide records already have L independent lanes and share one slot. Slots
+// are XORed together by fold.
+static constexpr size_t acc_slots(size_t L) { return L == 1 ? 8 : 1; }
+
+template <typename T> static inline const __m256i *lanes(const T *p) {
+  return reinterpret_cast<const __m256i *>(p);
+}
+template <typename T> static inline __m256i *lanes(T *p) {
+  return reinterpret_cast<__m256i *>(p);
+}
+
+static inline __m256i bit_mask(uint64_t bits, size_t k) {
+  return _mm256_set1_epi64x(-((bits >> k) & 1));
+}
+
+// XOR into the accumulators every record data[8 * g + k] whose bit k is
+// set in indexing[g], for groups g in [0, groups).
+template <size_t L>
+static inline void xor_groups(const __m256i *data, const uint8_t *indexing,
+                              size_t groups, __m256i *results) {
+  const size_t S = acc_slots(L);
+  __m256i acc[S * L];
+  std::copy(results, results + S * L, acc);
+  for (size_t g = 0; g < groups; g++) {
+    const __m256i *rec = data + 8 * L * g;
+    uint64_t tmp = indexing[g];
+    for (size_t k = 0; k < 8; k++) {
+      const __m256i mask = bit_mask(tmp, k);
+      for (size_t l = 0; l < L; l++)
+        acc[L * (k % S) + l] = _mm256_xor_si256(
+            acc[L * (k % S) + l], _mm256_and_si256(rec[L * k + l], mask));
+    }
+  }
+  std::copy(acc, acc + S * L, results);
+}
+
+// The last, partial group: records data[k] for k < count < 8.
+template <size_t L>
+static inline void xor_tail(const __m256i *data, uint8_t bits, size_t count,
+                            __m256i *results) {
+  const size_t S = acc_slots(L);
+  for (size_t k = 0; k < count; k++)
+    for (size_t l = 0; l < L; l++)
+      results[L * (k % S) + l] = _mm256_xor_si256(
+          results[L * (k % S) + l],
+          _mm256_and_si256(data[L * k + l], bit_mask(bits, k)));
+}
+
+// AVX-512: records are XORed in under a mask instead of ANDed with one.
+#define AVX512_TARGET __attribute__((target("avx512f,bmi2")))
+// GCC 12 flags the self-initialised placeholders inside its own AVX-512
+// intrinsics as uninitialised.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+// Wide records span L / 2 zmm registers, each with its own accumulator,
+// all under the record's mask (0 or 0xFF). With fewer than four registers
+// per record, even and odd records alternate between two accumulator sets
+// to keep enough XOR chains in flight.
+template <size_t L>
+AVX512_TARGET static void xor_groups_avx512(const __m256i *data,
+                                            const uint8_t *indexing,
+                                            size_t groups, __m256i *results) {
+  const size_t Z = L / 2, P = Z < 4 ? 2 : 1;
+  __m512i acc[P][Z];
+  for (size_t p = 0; p < P; p++)
+    for (size_t z = 0; z < Z; z++)
+      acc[p][z] = _mm512_setzero_si512();
+  for (size_t g = 0; g < groups; g++) {
+    const __m512i *rec = (const __m512i *)(data + 8 * L * g);
+    const uint32_t tmp = indexing[g];
+    for (size_t k = 0; k < 8; k++) {
+      const __mmask8 m = (__mmask8)(0U - ((tmp >> k) & 1));
+      for (size_t z = 0; z < Z; z++)
+        acc[k % P][z] = _mm512_mask_xor_epi64(
+            acc[k % P][z], m, acc[k % P][z],
+            _mm512_loadu_si512(rec + Z * k + z));
+    }
+  }
+  for (size_t z = 0; z < Z; z++) {
+    if (P == 2)
+      acc[0][z] = _mm512_xor_si512(acc[0][z], acc[P - 1][z]);
+    results[2 * z] =
+        _mm256_xor_si256(results[2 * z], _mm512_castsi512_si256(acc[0][z]));
+    results[2 * z + 1] = _mm256_xor_si256(
+        results[2 * z + 1], _mm512_extracti64x4_epi64(acc[0][z], 1));
+  }
+}
+
+// One-lane records: two records per zmm register. Bit k of an index byte
+// becomes the four qword lanes of record k: pdep spreads the byte to one
+// bit per nibble and * 0xF fills the nibbles, so byte p of the result
+// masks record pair (2p, 2p + 1).
+template <>
+AVX512_TARGET void xor_groups_avx512<1>(const __m256i *data,
+                                        const uint8_t *indexing, size_t groups,
+                                        __m256i *results) {
+  __m512i acc[8];
+  for (auto &a : acc)
+    a = _mm512_setzero_si512();
+  size_t g = 0;
+  // two groups per iteration: eight independent accumulator chains
+  for (; g + 2 <= groups; g += 2) {
+    const __m512i *rec = (const __m512i *)(data + 8 * g);
+    const uint64_t m = (uint64_t)(_pdep_u32(indexing[g], 0x11111111) * 0xFU) |
+                       (uint64_t)(_pdep_u32(indexing[g + 1], 0x11111111) * 0xFU)
+                           << 32;
+    for (int p = 0; p < 8; p++)
+      acc[p] = _mm512_mask_xor_epi64(acc[p], (__mmask8)(m >> (8 * p)), acc[p],
+                                     _mm512_loadu_si512(rec + p));
+  }
+  for (; g < groups; g++) {
+    const __m512i *rec = (const __m512i *)(data + 8 * g);
+    const uint32_t m = _pdep_u32(indexing[g], 0x11111111) * 0xFU;
+    for (int p = 0; p < 4; p++)
+      acc[p] = _mm512_mask_xor_epi64(acc[p], (__mmask8)(m >> (8 * p)), acc[p],
+                                     _mm512_loadu_si512(rec + p));
+  }
+  for (int p = 0; p < 4; p++)
+    acc[p] = _mm512_xor_si512(acc[p], acc[p + 4]);
+  acc[0] = _mm512_xor_si512(_mm512_xor_si512(acc[0], acc[1]),
+                            _mm512_xor_si512(acc[2], acc[3]));
+  results[0] = _mm256_xor_si256(results[0], _mm512_castsi512_si256(acc[0]));
+  results[1] = _mm256_xor_si256(results[1],
+                                _mm512_extracti64x4_epi64(acc[0], 1));
+}
+
+#pragma GCC diagnostic pop
+
+static bool cpuHasAVX512() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("bmi2");
+}
+
+// the scan kernel of the single-bitmap paths, chosen once from CPUID
+static bool g_useAVX512 = cpuHasAVX512();
+
+template <size_t L>
+static inline void scan_groups(const __m256i *data, const uint8_t *indexing,
+                               size_t groups, __m256i *results) {
+  if (g_useAVX512)
+    xor_groups_avx512<L>(data, indexing, groups, results);
+  else
+    xor_groups<L>(data, indexing, groups, results);
+}
+
+template <size_t R, typename P> bool basic_datastore<R, P>::HasAVX512() {
+  return g_useAVX512;
+}
+
+template <size_t R, typename P>
+void basic_datastore<R, P>::SetAVX512(bool enable) {
+  g_useAVX512 = enable && cpuHasAVX512();
+}
+
+// out = XOR of the accumulator slots.
+template <size_t L>
+static inline void fold(const __m256i *results, __m256i *out) {
+  for (size_t l = 0; l < L; l++) {
+    __m256i x = results[l];
+    for (size_t s = 1; s < acc_slots(L); s++)
+      x = _mm256_xor_si256(x, results[L * s + l]);
+    out[l] = x;
+  }
+}
+
+template <size_t L>
+static inline void xor_into(__m256i *dst, const __m256i *src) {
+  for (size_t l = 0; l < L; l++)
+    dst[l] = _mm256_xor_si256(dst[l], src[l]);
+}
+
+template <size_t R, typename P>
+typename basic_datastore<R, P>::db_record
+basic_datastore<R, P>::answer_pir(span<const uint8_t> indexing) const {
+  return answer_pir(indexing, size());
+}
+
+template <size_t R, typename P>
+typename basic_datastore<R, P>::db_record
+basic_datastore<R, P>::answer_pir(span<const uint8_t> indexing,
+                               size_t n) const {
+  __m256i results[acc_slots(kLanes) * kLanes] = {};
+  assert(n <= size());
+  assert(indexing.size() >= (n + 7) / 8);
+
+  const __m256i *data = lanes(this->data());
+  scan_groups<kLanes>(data, indexing.data(), n / 8, results);
+  if (n % 8)
+    xor_tail<kLanes>(data + n / 8 * 8 * kLanes, indexing[n / 8], n % 8,
+                     results);
+  db_record result;
+  fold<kLanes>(results, lanes(&result));
+  return result;
+}
+
+template <size_t R, typename P>
+typename basic_datastore<R, P>::db_record
+basic_datastore<R, P>::answer_pir_parallel(span<const uint8_t> indexing,
+                                        size_t n, size_t threads) const {
+  assert(n <= size());
+  assert(indexing.size() >= (n + 7) / 8);
+  const size_t groups = n / 8;
+  const size_t blocks = (groups + kScanBlockBytes - 1) / kScanBlockBytes;
+  if (threads == 0)
+    threads = omp_get_max_threads();
+  threads = std::max((size_t)1, std::min(threads, blocks));
+
+  // one partial per thread, a cache line apart
+  const size_t stride = kLanes == 1 ? 2 : 1;
+  const __m256i *data = lanes(this->data());
+  aligned_vector partial(stride * threads, db_record());
+#pragma omp parallel num_threads(threads)
+  {
+    const size_t t = omp_get_thread_num(), T = omp_get_num_threads();
+    const size_t first = blocks * t / T * kScanBlockBytes;
+    const size_t last =
+        std::min(groups, blocks * (t + 1) / T * kScanBlockBytes);
+    __m256i results[acc_slots(kLanes) * kLanes] = {};
+    if (first < last)
+      scan_groups<kLanes>(data + 8 * kLanes * first, indexing.data() + first,
+                          last - first, results);
+    fold<kLanes>(results, lanes(&partial[stride * t]));
+  }
+
+  db_record result = db_record();
+  for (size_t t = 0; t < threads; t++)
+    xor_into<kLanes>(lanes(&result), lanes(&partial[stride * t]));
+  if (n % 8) {
+    __m256i tail[acc_slots(kLanes) * kLanes] = {};
+    db_record rest;
+    xor_tail<kLanes>(data + 8 * kLanes * groups, indexing[groups], n % 8,
+                     tail);
+    fold<kLanes>(tail, lanes(&rest));
+    xor_into<kLanes>(lanes(&result), lanes(&rest));
+  }
+  return result;
+}
+
+// Groups [first, last) of data against the bitmaps bits[0..K), K <=
+// kBatchTile: each group's records are loaded once for all K bitmaps.
+template <size_t K, size_t L>
+static inline void xor_block_tile(const __m256i *data,
+                                  const uint8_t *const *bits, size_t first,
+                                  size_t last, __m256i *answers) {
+  __m256i acc[K * L];
+  for (size_t i = 0; i < K * L; i++)
+    acc[i] = _mm256_setzero_si256();
+  for (size_t g = first; g < last; g++) {
+    const __m256i *rec = data + 8 * L * g;
+    for (size_t j = 0; j < K; j++) {
+      uint64_t tmp = bits[j][g];
+      for (size_t k = 0; k < 8; k++) {
+        const __m256i mask = bit_mask(tmp, k);
+        for (size_t l = 0; l < L; l++)
+          acc[L * j + l] = _mm256_xor_si256(
+              acc[L * j + l], _mm256_and_si256(rec[L * k + l], mask));
+      }
+    }
+  }
+  xor_into<K * L>(answers, acc);
+}
+
+// Shared driver of the batch scans: splits the groups of n records into
+// whole scan blocks across threads, runs scan(bits, first, last, acc) on
+// each thread's groups [first, last) with per-thread answers acc, XORs
+// those together and adds the trailing partial group.
+template <size_t L, typename Answers, typename Scan>
+static void scan_batch(const __m256i *data, size_t n,
+                       const std::vector<std::vector<uint8_t>> &bitmaps,
+                       Answers &answers, size_t threads, size_t block_bytes,
+                       const Scan &scan) {
+  const size_t batch = bitmaps.size();
+  answers.assign(batch, typename Answers::value_type());
+  if (batch == 0)
+    return;
+  std::vector<const uint8_t *> bits(batch);
+  for (size_t j = 0; j < batch; j++) {
+    assert(bitmaps[j].size() >= (n + 7) / 8);
+    bits[j] = bitmaps[j].data();
+  }
+  const size_t groups = n / 8;
+  const size_t blocks = (groups + block_bytes - 1) / block_bytes;
+  if (threads == 0)
+    threads = omp_get_max_threads();
+  threads = std::max((size_t)1, std::min(threads, blocks));
+
+  std::vector<Answers> partial(threads);
+#pragma omp parallel num_threads(threads)
+  {
+    const size_t t = omp_get_thread_num(), T = omp_get_num_threads();
+    partial[t].assign(batch, typename Answers::value_type());
+    scan(bits.data(), blocks * t / T * block_bytes,
+         std::min(groups, blocks * (t + 1) / T * block_bytes),
+         lanes(partial[t].data()));
+  }
+
+  for (size_t t = 0; t < threads; t++)
+    for (size_t j = 0; j < batch && !partial[t].empty(); j++)
+      xor_into<L>(lanes(&answers[j]), lanes(&partial[t][j]));
+  if (n % 8) {
+    for (size_t j = 0; j < batch; j++) {
+      __m256i tail[acc_slots(L) * L] = {}, rest[L];
+      xor_tail<L>(data + 8 * L * groups, bits[j][groups], n % 8, tail);
+      fold<L>(tail, rest);
+      xor_into<L>(lanes(&answers[j]), rest);
+    }
+  }
+}
+
+template <size_t R, typename P>
+void basic_datastore<R, P>::answer_pir_batch(
+    const std::vector<std::vector<uint8_t>> &bitmaps, aligned_vector &answers,
+    size_t threads) const {
+  if (bitmaps.size() >= kTableMinBatch)
+    answer_pir_batch_table(bitmaps, answers, threads);
+  else
+    answer_pir_batch_tiled(bitmaps, answers, threads);
+}
+
+template <size_t R, typename P>
+void basic_datastore<R, P>::answer_pir_batch_tiled(
+    const std::vector<std::vector<uint8_t>> &bitmaps, aligned_vector &answers,
+    size_t threads) const {
+  const size_t batch = bitmaps.size();
+  const __m256i *data = lanes(this->data());
+  scan_batch<kLanes>(
+      data, size(), bitmaps, answers, threads, kScanBlockBytes,
+      [&](const uint8_t *const *bits, size_t first, size_t last,
+          __m256i *acc) {
+        // the same 16 KiB of records per block whatever their width
+        const size_t block = std::max<size_t>(1, kScanBlockBytes / kLanes);
+        for (size_t b = first; b < last; b += block) {
+          const size_t end = std::min(last, b + block);
+          size_t j = 0;
+          for (; j + kBatchTile <= batch; j += kBatchTile)
+            xor_block_tile<kBatchTile, kLanes>(data, bits + j, b, end,
+                                               acc + kLanes * j);
+          for (; j < batch; j++)
+            xor_block_tile<1, kLanes>(data, bits + j, b, end,
+                                      acc + kLanes * j);
+        }
+      });
+}
+
+// table[b] = XOR of the records rec[k] with bit k set in b, in 255 XORs.
+// The 16 entries over the low four records follow the Gray code: gray(i) =
+// i ^ (i >> 1) differs from gray(i - 1) in bit ctz(i) only, so each is one
+// XOR from the one before, kept in registers. Each higher record then
+// doubles the table with independent XORs, which (unlike one 255-long
+// Gray chain) do not serialise on the XOR latency.
+template <size_t L>
+static inline void subset_table(const __m256i *rec, __m256i *table) {
+  __m256i cur[L];
+  for (size_t l = 0; l < L; l++)
+    table[l] = cur[l] = _mm256_setzero_si256();
+  for (size_t i = 1; i < 16; i++) {
+    const __m256i *r = rec + L * __builtin_ctz(i);
+    __m256i *t = table + L * (i ^ (i >> 1));
+    for (size_t l = 0; l < L; l++)
+      t[l] = cur[l] = _mm256_xor_si256(cur[l], r[l]);
+  }
+  for (size_t k = 4; k < 8; k++) {
+    const __m256i *r = rec + L * k;
+    for (size_t i = 0; i < (1U << k); i++)
+      for (size_t l = 0; l < L; l++)
+        table[L * ((1U << k) + i) + l] =
+            _mm256_xor_si256(table[L * i + l], r[l]);
+  }
+}
+
+template <size_t R, typename P>
+void basic_datastore<R, P>::answer_pir_batch_table(
+    const std::vector<std::vector<uint8_t>> &bitmaps, aligned_vector &answers,
+    size_t threads) const {
+  const size_t batch = bitmaps.size();
+  const __m256i *data = lanes(this->data());
+  scan_batch<kLanes>(
+      data, size(), bitmaps, answers, threads, kScanBlockBytes,
+      [&](const uint8_t *const *bits, size_t first, size_t last,
+          __m256i *acc) {
+        aligned_vector table(256);
+        const __m256i *t = lanes(table.data());
+        for (size_t g = first; g < last; g++) {
+          subset_table<kLanes>(data + 8 * kLanes * g, lanes(table.data()));
+          for (size_t j = 0; j < batch; j++)
+            xor_into<kLanes>(acc + kLanes * j, t + kLanes * bits[j][g]);
+        }
+      });
+}
+
+template <size_t R, typename P>
+typename basic_datastore<R, P>::db_record
+basic_datastore<R, P>::answer_dpf(const DPF::Key &key, size_t logn) const {
+  __m256i results[acc_slots(kLanes) * kLanes] = {};
+  assert(size() <= 8 * DPF::EvalFullSize(key, logn));
+
+  const __m256i *data = lanes(this->data());
+  const size_t groups = size() / 8, rest = size() % 8;
+  DPF::EvalFullTiles(key, logn, kDpfTileBytes,
+                     [&](size_t offset, const uint8_t *tile, size_t len) {
+                       if (offset >= groups + (rest != 0))
+                         return;
+                       size_t n = std::min(len, groups - std::min(offset, groups));
+                       scan_groups<kLanes>(data + 8 * kLanes * offset, tile, n,
+                                           results);
+                       if (rest && offset + len > groups)
+                         xor_tail<kLanes>(data + 8 * kLanes * groups,
+                                          tile[groups - offset], rest, results);
+                     });
+  db_record result;
+  fold<kLanes>(results, lanes(&result));
   return result;
-}
\ No newline at end of file
+}
+
+template <size_t R, typename P>
+typename basic_datastore<R, P>::db_record
+basic_datastore<R, P>::answer_dpf(const std::vector<uint8_t> &key,
+                               size_t logn) const {
+  return answer_dpf(DPF::Key(key), logn);
+}
+
+// Record group data[0..8) selected by the bitmap byte of each of k keys,
+// bits[j * stride]: the records are loaded once and XORed into every key's
+// accumulator.
+template <size_t L>
+static inline void xor_group_multi(const __m256i *data, const uint8_t *bits,
+                                   size_t stride, size_t k, __m256i *results) {
+  // narrow records are kept in registers across the keys
+  __m256i copy[L <= 2 ? 8 * L : 1];
+  const __m256i *r = data;
+  if (L <= 2)
+    r = std::copy(data, data + 8 * L, copy) - 8 * L;
+  for (size_t j = 0; j < k; j++) {
+    uint64_t tmp = bits[j * stride];
+    for (size_t i = 0; i < 8; i++) {
+      const __m256i mask = bit_mask(tmp, i);
+      for (size_t l = 0; l < L; l++)
+        results[L * j + l] = _mm256_xor_si256(
+            results[L * j + l], _mm256_and_si256(r[L * i + l], mask));
+    }
+  }
+}
+
+template <size_t R, typename P>
+typename basic_datastore<R, P>::aligned_vector
+basic_datastore<R, P>::answer_dpf_multi(const std::vector<DPF::Key> &keys,
+                                     size_t logn) const {
+  const size_t k = keys.size();
+  std::vector<std::unique_ptr<DPF::Expander>> expanders;
+  for (const auto &key : keys) {
+    assert(size() <= 8 * DPF::EvalFullSize(key, logn));
+    expanders.emplace_back(new DPF::Expander(key, logn, kDpfTileBytes));
+  }
+  std::vector<uint8_t> bits(k * kMultiChunkBytes);
+  aligned_vector results(k, db_record());
+  const __m256i *data = lanes(this->data());
+
+  const size_t groups = size() / 8, rest = size() % 8;
+  const size_t total = groups + (rest != 0);
+  for (size_t offset = 0; offset < total; offset += kMultiChunkBytes) {
+    const size_t n = std::min(kMultiChunkBytes, total - offset);
+    for (size_t j = 0; j < k; j++) {
+      size_t got = expanders[j]->NextChunk(
+          span<uint8_t>(bits.data() + j * kMultiChunkBytes, n));
+      assert(got == n);
+      (void)got;
+    }
+    const size_t full = std::min(n, groups - std::min(offset, groups));
+    for (size_t g = 0; g < full; g++)
+      xor_group_multi<kLanes>(data + 8 * kLanes * (offset + g),
+                              bits.data() + g, kMultiChunkBytes, k,
+                              lanes(results.data()));
+    if (full < n) {
+      // the last, partial group: one accumulator set per key
+      for (size_t j = 0; j < k; j++) {
+        __m256i tail[acc_slots(kLanes) * kLanes] = {}, last[kLanes];
+        xor_tail<kLanes>(data + 8 * kLanes * groups,
+                         bits[j * kMultiChunkBytes + full], rest, tail);
+        fold<kLanes>(tail, last);
+        xor_into<kLanes>(lanes(&results[j]), last);
+      }
+    }
+  }
+  return results;
+}
+
+static const char kFileMagic[8] = {'D', 'P', 'F', 'P', 'I', 'R', 'D', 'B'};
+
+static std::runtime_error file_error(const char *what,
+                                     const std::string &path) {
+  return std::runtime_error(std::string(what) + " " + path + ": " +
+                            std::strerror(errno));
+}
+
+template <size_t R, typename P>
+void basic_datastore<R, P>::save(const std::string &path, size_t align) const {
+  assert(align >= (size_t)sysconf(_SC_PAGESIZE) && (align & (align - 1)) == 0);
+  datastore_file_header header = {};
+  std::memcpy(header.magic, kFileMagic, sizeof(header.magic));
+  header.version = kFileVersion;
+  header.record_bytes = R;
+  header.count = size();
+  header.data_offset = align;
+
+  FILE *f = std::fopen(path.c_str(), "wb");
+  if (!f)
+    throw file_error("cannot create", path);
+  const std::vector<char> pad(align - sizeof(header));
+  bool ok = std::fwrite(&header, sizeof(header), 1, f) == 1 &&
+            std::fwrite(pad.data(), 1, pad.size(), f) == pad.size() &&
+            std::fwrite(data(), R, size(), f) == size();
+  ok = std::fclose(f) == 0 && ok;
+  if (!ok)
+    throw file_error("cannot write", path);
+}
+
+template <size_t R, typename P>
+basic_datastore<R, P> basic_datastore<R, P>::open_mmap(const std::string &path,
+                                                 unsigned flags) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw file_error("cannot open", path);
+  datastore_file_header header;
+  struct stat st;
+  if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+      fstat(fd, &st) != 0) {
+    close(fd);
+    throw std::runtime_error(path + ": no database header");
+  }
+  const size_t page = sysconf(_SC_PAGESIZE);
+  if (std::memcmp(header.magic, kFileMagic, sizeof(kFileMagic)) != 0 ||
+      header.version != kFileVersion || header.record_bytes != R ||
+      header.data_offset < sizeof(header) || header.data_offset % page != 0) {
+    close(fd);
+    throw std::runtime_error(path + ": not a version " +
+                             std::to_string(kFileVersion) + " database of " +
+                             std::to_string(R) + "-byte records");
+  }
+  // a corrupt count must not wrap the length round to a small mapping
+  if (header.count > (SIZE_MAX - header.data_offset) / R ||
+      (size_t)st.st_size < header.data_offset + header.count * R) {
+    close(fd);
+    throw std::runtime_error(path + ": truncated database");
+  }
+  const size_t len = header.data_offset + header.count * R;
+
+  // With huge pages the advice has to come before the faults, so the
+  // population is done after madvise instead of by mmap.
+  const bool huge = flags & kMapHugePages, populate = flags & kMapPopulate;
+  void *base = mmap(nullptr, len, PROT_READ,
+                    MAP_SHARED | (populate && !huge ? MAP_POPULATE : 0), fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    throw file_error("cannot map", path);
+  if (huge) {
+    madvise(base, len, MADV_HUGEPAGE); // advice only; may be unsupported
+    bool populated = false;
+#ifdef MADV_POPULATE_READ
+    populated = populate && madvise(base, len, MADV_POPULATE_READ) == 0;
+#endif
+    if (populate && !populated) {
+      // kernels or headers before 5.14: touch every page
+      volatile const char *p = (const char *)base;
+      for (size_t off = 0; off < len; off += page)
+        (void)p[off];
+    }
+  }
+
+  basic_datastore store;
+  store.mapping_ = std::shared_ptr<const void>(
+      base, [len](const void *p) { munmap(const_cast<void *>(p), len); });
+  store.mapped_ = (const db_record *)((const char *)base + header.data_offset);
+  store.mapped_size_ = header.count;
+  return store;
+}
+
+#define INSTANTIATE_WIDTHS(Pages)                                              \
+  template class basic_datastore<32, Pages>;                                   \
+  template class basic_datastore<64, Pages>;                                   \
+  template class basic_datastore<256, Pages>;                                  \
+  template class basic_datastore<1024, Pages>;
+INSTANTIATE_WIDTHS(DefaultPages)
+INSTANTIATE_WIDTHS(HugePages<>)
+INSTANTIATE_WIDTHS(HugePages<1ULL << 30>)
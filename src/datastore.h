@@ -1,30 +1,220 @@
 #pragma once
 
+#include <cassert>
 #include <cstdint>
 #include <iostream>
+#include <memory>
+#include <string>
 #include <vector>
 #include <x86intrin.h>
 
+#include "util/Defines.h"
 #include "util/alignment_allocator.h"
 
-class datastore {
+namespace DPF {
+struct Key;
+}
+
+// A record wider than one AVX2 register: RecordBytes / 32 lanes, scanned
+// one register at a time.
+template <size_t RecordBytes> struct wide_record {
+  __m256i lane[RecordBytes / 32];
+};
+
+template <size_t RecordBytes> struct record_type {
+  typedef wide_record<RecordBytes> type;
+};
+template <> struct record_type<32> { typedef __m256i type; };
+
+// On-disk database written by basic_datastore::save and served in place
+// by open_mmap: this header, zero padding up to data_offset, then count
+// records of record_bytes each. data_offset is a multiple of the page
+// size, so mapped records keep their 64-byte alignment.
+struct datastore_file_header {
+  char magic[8]; // "DPFPIRDB"
+  uint32_t version;
+  uint32_t record_bytes;
+  uint64_t count;
+  uint64_t data_offset;
+};
+
+// The record store and its scans, for records of RecordBytes bytes (32 or
+// a multiple of 64). Every kernel works on 32-byte lanes and loops over
+// the lanes of a record, so the cost per byte does not depend on the
+// width. The records and the store's vectors take their memory from the
+// Pages policy of util/alignment_allocator.h (DefaultPages, or
+// HugePages<> for 2 MiB and HugePages<1ULL << 30> for 1 GiB pages). The
+// member functions are instantiated in datastore.cpp for 32, 64, 256 and
+// 1024-byte records under each of the three.
+template <size_t RecordBytes, typename Pages = DefaultPages>
+class basic_datastore {
+  static_assert(RecordBytes == 32 || (RecordBytes > 0 && RecordBytes % 64 == 0),
+                "records are 32 bytes or a multiple of 64");
+
 public:
-  typedef __m256i db_record;
-  typedef std::vector<db_record, AlignmentAllocator<db_record, sizeof(db_record)>> aligned_vector;
+  typedef typename record_type<RecordBytes>::type db_record;
+  // cache-line aligned, so every 2-record pair shares one line
+  typedef std::vector<db_record, AlignmentAllocator<db_record, 64, Pages>>
+      aligned_vector;
+  // A bitmap buffer on the same pages, for DPF::EvalFullInto; the scans
+  // take any contiguous bitmap.
+  typedef std::vector<uint8_t, AlignmentAllocator<uint8_t, 64, Pages>>
+      bitmap_vector;
+  static const size_t kRecordBytes = RecordBytes;
+  static const size_t kLanes = RecordBytes / 32;
+
+  basic_datastore() = default;
+
+  // A mapped store (open_mmap) is read-only.
+  void reserve(size_t n) {
+    assert(!mapped());
+    data_.reserve(n);
+  }
+  void resize(size_t n) {
+    assert(!mapped());
+    data_.resize(n);
+  }
+  void push_back(const db_record &data) {
+    assert(!mapped());
+    data_.push_back(data);
+  }
+  void push_back(db_record &&data) {
+    assert(!mapped());
+    data_.push_back(data);
+  }
 
-  datastore() = default;
+  void dummy(size_t n) {
+    assert(!mapped());
+    db_record r;
+    for (size_t l = 0; l < kLanes; l++)
+      ((__m256i *)&r)[l] = _mm256_set_epi64x(1, 2, 3, 4);
+    data_.resize(n, r);
+  }
 
-  void reserve(size_t n) { data_.reserve(n); }
-  void resize(size_t n) { data_.resize(n); }
-  void push_back(const db_record &data) { data_.push_back(data); }
-  void push_back(db_record &&data) { data_.push_back(data); }
+  size_t size() const { return mapped() ? mapped_size_ : data_.size(); }
+  const db_record *data() const { return mapped() ? mapped_ : data_.data(); }
+  bool mapped() const { return mapping_ != nullptr; }
 
-  void dummy(size_t n) { data_.resize(n, _mm256_set_epi64x(1, 2, 3, 4)); }
+  static const uint32_t kFileVersion = 1;
+  // open_mmap flags
+  enum : unsigned { kMapPopulate = 1, kMapHugePages = 2 };
 
-  size_t size() const { return data_.size(); }
+  // Writes the records in the datastore_file_header format, starting at a
+  // multiple of `align` (a power of two, at least the page size; 2 MiB
+  // lets a huge-page mapping cover them). Throws std::runtime_error on
+  // I/O failure.
+  void save(const std::string &path, size_t align = 4096) const;
+  // A store answering straight from a read-only shared mapping of a file
+  // written by save, with nothing copied or rebuilt; copies share the
+  // mapping and the last one unmaps it. kMapPopulate faults the file in
+  // up front (MAP_POPULATE) rather than during the first scan;
+  // kMapHugePages asks for transparent huge pages (MADV_HUGEPAGE, honoured
+  // where the kernel backs file mappings with them). Throws
+  // std::runtime_error if the file is unreadable, truncated or holds
+  // another record width.
+  static basic_datastore open_mmap(const std::string &path,
+                                   unsigned flags = 0);
 
-  db_record answer_pir(const std::vector<uint8_t> &indexing) const;
+  // The single-bitmap scans (answer_pir, answer_pir_parallel, answer_dpf)
+  // use an AVX-512 kernel when CPUID reports it, AVX2 otherwise.
+  // SetAVX512(false) forces the AVX2 kernel, e.g. for comparisons.
+  static bool HasAVX512();
+  static void SetAVX512(bool enable);
+
+  db_record answer_pir(span<const uint8_t> indexing) const;
+  // XOR of the first n records selected by indexing; the scan stops at n,
+  // which need not be a multiple of 8.
+  db_record answer_pir(span<const uint8_t> indexing, size_t n) const;
+  // answer_pir with the records split across `threads` OpenMP threads
+  // (0 = all). Each thread scans a contiguous run of whole scan blocks into
+  // its own accumulators and the partial answers are XORed at the end.
+  db_record answer_pir_parallel(span<const uint8_t> indexing,
+                                size_t n, size_t threads = 0) const;
+  // The same for a bitmap in a std::vector, temporaries included.
+  db_record answer_pir(const std::vector<uint8_t> &indexing) const {
+    return answer_pir(bitmap(indexing));
+  }
+  db_record answer_pir(const std::vector<uint8_t> &indexing, size_t n) const {
+    return answer_pir(bitmap(indexing), n);
+  }
+  db_record answer_pir_parallel(const std::vector<uint8_t> &indexing,
+                                size_t n, size_t threads = 0) const {
+    return answer_pir_parallel(bitmap(indexing), n, threads);
+  }
+
+  // One answer per bitmap, all from a single pass over the records: each
+  // block of kScanBlockBytes groups (fewer for wide records, 16 KiB of
+  // records in all) is loaded into L1 once and applied to every bitmap,
+  // kBatchTile at a time with their accumulators in registers. Blocks are
+  // split across `threads` OpenMP threads (0 = all). From kTableMinBatch
+  // bitmaps on it hands over to answer_pir_batch_table;
+  // answer_pir_batch_tiled always takes the masked-XOR scan.
+  void answer_pir_batch(const std::vector<std::vector<uint8_t>> &bitmaps,
+                        aligned_vector &answers, size_t threads = 0) const;
+  void answer_pir_batch_tiled(const std::vector<std::vector<uint8_t>> &bitmaps,
+                              aligned_vector &answers,
+                              size_t threads = 0) const;
+
+  // answer_pir_batch by table lookup ("Four Russians"): for each group of
+  // 8 records the XOR of every subset is tabulated (256 records, built in
+  // Gray-code order with 255 XORs), after which a bitmap byte costs one
+  // lookup and one XOR instead of eight masked XORs. Pays off once the
+  // batch amortises the table, from about kTableMinBatch bitmaps. The
+  // table is 256 x RecordBytes: 8 KiB at 32 bytes, but 256 KiB at 1 KiB,
+  // which no longer fits in L1.
+  void answer_pir_batch_table(const std::vector<std::vector<uint8_t>> &bitmaps,
+                              aligned_vector &answers,
+                              size_t threads = 0) const;
+
+  // Fused DPF expansion and scan: the bitmap is produced one L1-sized tile
+  // at a time and consumed immediately, never materialised in full. With
+  // a truncated-domain key (DPF::Gen's domain = size()) no tile past the
+  // last record is expanded.
+  db_record answer_dpf(const DPF::Key &key, size_t logn) const;
+  // The same for a key still in its wire format; parses it first.
+  db_record answer_dpf(const std::vector<uint8_t> &key, size_t logn) const;
+
+  // answer_dpf for each of several keys, in a single pass over the
+  // records: their bitmaps are streamed side by side a chunk at a time and
+  // every record is loaded once for all of them. The keys are ordinary
+  // point keys; answer j is the one answer_dpf(keys[j], logn) gives.
+  aligned_vector answer_dpf_multi(const std::vector<DPF::Key> &keys,
+                                  size_t logn) const;
+
+  // Bitmap bytes per scan block in answer_pir_parallel: one cache line of
+  // bitmap, 512 records, so no two threads share a line of either.
+  static const size_t kScanBlockBytes = 64;
+  // Bitmaps applied together to a record block in answer_pir_batch: 8
+  // accumulators and the 8 records of a group fill the 16 ymm registers.
+  // Wider records take proportionally fewer.
+  static const size_t kBatchTile = kLanes < 8 ? 8 / kLanes : 1;
+  // Batch size from which answer_pir_batch_table beats the tiled scan
+  // (measured with cpu_bench mode=crossover and mode=width): later once the
+  // table outgrows L1, past 128-byte records.
+  static const size_t kTableMinBatch = 256 * RecordBytes <= 32768 ? 32 : 96;
+  // Bitmap bytes per tile in answer_dpf (covers 8x as many records).
+  static const size_t kDpfTileBytes = 4096;
+  // Bitmap bytes per key and chunk in answer_dpf_multi; the k chunks stay
+  // in L1 while the chunk's 2048 records stream past.
+  static const size_t kMultiChunkBytes = 256;
 
 private:
+  static span<const uint8_t> bitmap(const std::vector<uint8_t> &v) {
+    return span<const uint8_t>(v.data(), v.size());
+  }
+
   aligned_vector data_;
+  // set by open_mmap, in place of data_
+  std::shared_ptr<const void> mapping_;
+  const db_record *mapped_ = nullptr;
+  size_t mapped_size_ = 0;
 };
+
+template <size_t RecordBytes, typename Pages>
+const size_t basic_datastore<RecordBytes, Pages>::kScanBlockBytes;
+template <size_t RecordBytes, typename Pages>
+const size_t basic_datastore<RecordBytes, Pages>::kBatchTile;
+template <size_t RecordBytes, typename Pages>
+const size_t basic_datastore<RecordBytes, Pages>::kMultiChunkBytes;
+
+typedef basic_datastore<32> datastore;
@@ -1,35 +1,68 @@
 #include "dpf.h"
 #include "../prf/AES.h"
+#include "../prf/AESNI.h"
 #include "../prf/PRNG.h"
 #include "../util/Log.h"
+#include <algorithm>
 #include <cassert>
+#include <functional>
+#include <immintrin.h>
 #include <iostream>
+#include <omp.h>
+#include <random>
+#include <stdexcept>
 
 namespace DPF {
 namespace prg {
 inline block getL(const block &seed) {
-  return mFixedKey.encryptECB_MMO(seed);
+  return mFixedKeyNI.encryptECB_MMO(seed);
 }
 
 inline block getR(const block &seed) {
-  return mFixedKey2.encryptECB_MMO(seed);
+  return mFixedKeyNI2.encryptECB_MMO(seed);
 }
 inline std::array<block, 8> getL8(const std::array<block, 8> &seed) {
   std::array<block, 8> out;
-  mFixedKey.encryptECB_MMO_Blocks(seed.data(), 8, out.data());
+  mFixedKeyNI.encryptECB_MMO8(seed.data(), out.data());
   return out;
 }
 
 inline std::array<block, 8> getR8(const std::array<block, 8> &seed) {
   std::array<block, 8> out;
-  mFixedKey2.encryptECB_MMO_Blocks(seed.data(), 8, out.data());
+  mFixedKeyNI2.encryptECB_MMO8(seed.data(), out.data());
   return out;
 }
+
+// Left and right children of N seeds with both fixed keys interleaved
+// round by round, so 2N blocks are in flight.
+template <size_t N>
+inline void getLR(const block *seed, block *L, block *R) {
+  const block *kL = mFixedKeyNI.rk;
+  const block *kR = mFixedKeyNI2.rk;
+  for (size_t i = 0; i < N; i++) {
+    L[i] = _mm_xor_si128(seed[i], kL[0]);
+    R[i] = _mm_xor_si128(seed[i], kR[0]);
+  }
+  for (int r = 1; r < 10; r++) {
+    for (size_t i = 0; i < N; i++) {
+      L[i] = _mm_aesenc_si128(L[i], kL[r]);
+      R[i] = _mm_aesenc_si128(R[i], kR[r]);
+    }
+  }
+  for (size_t i = 0; i < N; i++) {
+    L[i] = _mm_aesenclast_si128(L[i], kL[10]) ^ seed[i];
+    R[i] = _mm_aesenclast_si128(R[i], kR[10]) ^ seed[i];
+  }
+}
 } 
 
 // namespace prg
 inline block clr(block in) { return in & ~MSBBlock; }
 inline bool getT(block in) { return !is_zero(in & MSBBlock); }
+// all-ones if the control bit (MSB) of in is set, zero otherwise
+inline block getTMask(block in) {
+  return _mm_srai_epi32(_mm_shuffle_epi32(in, 0xFF), 31);
+}
 inline void clr8(std::array<block, 8> &in) {
   for (int i = 0; i < 8; i++) {
     in[i] &= ~MSBBlock;
@@ -43,124 +76,553 @@ inline std::array<uint8_t, 8> getT8(const std::array<block, 8> &in) {
   return out;
 }
 inline bool ConvertBit(block in) { return !is_zero(in & LSBBlock); }
-inline block ConvertBlock(block in) { return mFixedKey.encryptECB(in); }
+inline block ConvertBlock(block in) { return mFixedKeyNI.encryptECB(in); }
 
 inline std::array<block, 8> ConvertBlock8(const std::array<block, 8> &in) {
   std::array<block, 8> out;
-  mFixedKey.encryptECBBlocks(in.data(), 8, out.data());
+  mFixedKeyNI.encryptECB8(in.data(), out.data());
   return out;
 }
 
-std::pair<std::vector<uint8_t>, std::vector<uint8_t>> Gen(size_t alpha,
-                                                          size_t logn) {
-  assert(logn <= 63);
-  assert(alpha < (1ULL << logn));
-  std::vector<uint8_t> ka, kb, CW;
-  PRNG p = PRNG::getTestPRNG();
-  block s0, s1;
-  uint8_t t0, t1;
-  p.get((uint8_t *)&s0, sizeof(s0));
-  p.get((uint8_t *)&s1, sizeof(s1));
-  t0 = getT(s0);
-  t1 = !t0;
-
-  s0 = clr(s0);
-  s1 = clr(s1);
-
-  ka.insert(ka.end(), (uint8_t *)&s0, ((uint8_t *)&s0) + sizeof(s0));
-  ka.push_back(t0);
-  kb.insert(kb.end(), (uint8_t *)&s1, ((uint8_t *)&s1) + sizeof(s1));
-  kb.push_back(t1);
-  //        std::cout << ka.hex() << std::endl;
-  //        std::cout << kb.hex() << std::endl;
-  size_t stop = logn >= 7 ? logn - 7 : 0; // pack 7 layers in final CW
+// Key layout: format byte | root seed (16) | root t (1) | per level sCW (16),
+// tLCW (1), tRCW (1) | final CW (16 << leaf_log). The format byte holds
+// leaf_log in bits 0-1 and the scheme in bits 4-7; the tree stops
+// 7 + leaf_log levels above the leaves and each leaf seed is converted into
+// 2^leaf_log blocks, block j hashing seed ^ j. Half-tree keys carry the
+// control bit in the seed's LSB, so they have no t bytes: format byte |
+// root seed (16) | per level CW (16) | final CW (16 << leaf_log).
+// GGM4 keys have the GGM header and one entry per 4-ary level (two tree
+// levels): the sCWs of its four children (4 x 16), then their tCWs (4 x 1).
+// Bit 2 of the format byte marks a truncated domain: the number of points
+// follows the format byte as 8 little-endian bytes.
+static const size_t kHeaderBytes = 1;
+static const uint8_t kDomainFlag = 0x04;
+static const size_t kMaxLeafLog = 3;
+
+static inline size_t TreeStop(size_t logn, size_t leaf_log) {
+  return logn >= 7 + leaf_log ? logn - 7 - leaf_log : 0;
+}
+
+// Wire parsing happens once, here; evaluators read the aligned fields.
+// Keys come off the wire, so a malformed one throws std::invalid_argument
+// rather than reading past the buffer, cw or final.
+Key::Key(span<const uint8_t> wire) {
+  if (wire.size() < kHeaderBytes)
+    throw std::invalid_argument("DPF key: empty");
+  const uint8_t format = wire[0];
+  if ((format & 0x08) != 0 || (format >> 4) > (int)Scheme::GGM4)
+    throw std::invalid_argument("DPF key: unknown format byte");
+  leaf_log = format & 3;
+  scheme = (Scheme)(format >> 4);
+  const size_t head = kHeaderBytes + (format & kDomainFlag ? 8 : 0) + 16 +
+                      (scheme != Scheme::HalfTree);
+  if (wire.size() < head + (16ULL << leaf_log))
+    throw std::invalid_argument("DPF key: truncated");
+  const uint8_t *p = wire.data() + kHeaderBytes;
+  if (format & kDomainFlag) {
+    memcpy(&domain, p, 8);
+    p += 8;
+    if (domain == 0)
+      throw std::invalid_argument("DPF key: empty domain");
+  }
+  memcpy(&seed, p, 16);
+  p += 16;
+  size_t stride = 16;
+  if (scheme != Scheme::HalfTree) {
+    t = *p++;
+    stride = scheme == Scheme::GGM4 ? 34 : 18;
+  }
+  const size_t levels = wire.size() - head - (16ULL << leaf_log);
+  const uint8_t *fin = p + levels;
+  if (levels % stride != 0 || levels / stride > kMaxDepth)
+    throw std::invalid_argument("DPF key: bad level count");
+  depth = levels / stride;
+  // 4-ary levels come in pairs
+  if (scheme == Scheme::GGM4 && depth % 2 != 0)
+    throw std::invalid_argument("DPF key: odd GGM4 depth");
+  // the tree covers 2^(depth + 7 + leaf_log) points; a wider domain would
+  // size every bitmap by a number the levels cannot back
+  const size_t span_log = depth + 7 + leaf_log;
+  if (span_log < 64 && domain > (1ULL << span_log))
+    throw std::invalid_argument("DPF key: domain wider than the tree");
+  if (scheme == Scheme::GGM4) {
+    // 68 bytes per pair of levels; child j of the pair at lvl is kept in
+    // slot lvl + (j & 1) of cw / tL (j < 2) or cw_hi / tR (j >= 2)
+    for (size_t lvl = 0; lvl < depth; lvl += 2, p += 68) {
+      for (size_t j = 0; j < 4; j++) {
+        const size_t i = lvl + (j & 1);
+        memcpy(j < 2 ? &cw[i] : &cw_hi[i], p + 16 * j, 16);
+        (j < 2 ? tL : tR) |= (uint64_t)(p[64 + j] & 1) << i;
+      }
+    }
+    memcpy(final, fin, 16ULL << leaf_log);
+    return;
+  }
+  for (size_t lvl = 0; lvl < depth; lvl++, p += stride) {
+    memcpy(&cw[lvl], p, 16);
+    if (scheme == Scheme::GGM) {
+      tL |= (uint64_t)(p[16] & 1) << lvl;
+      tR |= (uint64_t)(p[17] & 1) << lvl;
+    }
+  }
+  memcpy(final, fin, 16ULL << leaf_log);
+}
+
+size_t Key::WireSize() const {
+  const size_t levels = scheme == Scheme::GGM        ? 1 + 18 * depth
+                        : scheme == Scheme::GGM4 ? 1 + 34 * depth
+                                                 : 16 * depth;
+  return kHeaderBytes + (domain ? 8 : 0) + 16 + levels + (16ULL << leaf_log);
+}
+
+void Key::Serialize(span<uint8_t> out) const {
+  assert((size_t)out.size() >= WireSize());
+  uint8_t *p = out.data();
+  *p++ = (uint8_t)(leaf_log | (domain ? kDomainFlag : 0) | ((int)scheme << 4));
+  if (domain) {
+    memcpy(p, &domain, 8);
+    p += 8;
+  }
+  memcpy(p, &seed, 16);
+  p += 16;
+  if (scheme != Scheme::HalfTree)
+    *p++ = t;
+  for (size_t lvl = 0; lvl < depth && scheme == Scheme::GGM4; lvl += 2) {
+    for (size_t j = 0; j < 4; j++) {
+      const size_t i = lvl + (j & 1);
+      memcpy(p + 16 * j, j < 2 ? &cw[i] : &cw_hi[i], 16);
+      p[64 + j] = ((j < 2 ? tL : tR) >> i) & 1;
+    }
+    p += 68;
+  }
+  for (size_t lvl = 0; lvl < depth && scheme != Scheme::GGM4; lvl++) {
+    memcpy(p, &cw[lvl], 16);
+    p += 16;
+    if (scheme == Scheme::GGM) {
+      *p++ = (tL >> lvl) & 1;
+      *p++ = (tR >> lvl) & 1;
+    }
+  }
+  memcpy(p, final, 16ULL << leaf_log);
+}
+
+std::vector<uint8_t> Key::Serialize() const {
+  std::vector<uint8_t> wire(WireSize());
+  Serialize(wire);
+  return wire;
+}
+
+// Format byte, then the domain size if the domain is truncated.
+static void PushHeader(std::vector<uint8_t> &k, size_t leaf_log, Scheme scheme,
+                       uint64_t domain) {
+  k.push_back((uint8_t)(leaf_log | (domain ? kDomainFlag : 0) |
+                        ((int)scheme << 4)));
+  if (domain)
+    k.insert(k.end(), (uint8_t *)&domain, ((uint8_t *)&domain) + 8);
+}
+
+// Mask for the last output byte: clears the bits past a truncated domain.
+static uint8_t TailMask(const Key &key) {
+  return key.domain % 8 ? (uint8_t)((1U << (key.domain % 8)) - 1) : 0xFF;
+}
+
+inline block LeafCtr(size_t j) { return _mm_set_epi64x(0, j); }
+
+// All 2^leaf_log blocks of the leaf seed s in one multi-block AES call.
+static void ConvertLeaf(block s, uint8_t t, size_t leaf_log,
+                        const block *finalCW, uint8_t *out) {
+  const size_t B = 1ULL << leaf_log;
+  block in[1ULL << kMaxLeafLog];
+  for (size_t j = 0; j < B; j++)
+    in[j] = s ^ LeafCtr(j);
+  mFixedKeyNI.encryptECBBlocks(in, B, in);
+  for (size_t j = 0; j < B; j++) {
+    if (t)
+      in[j] ^= finalCW[j];
+    _mm_storeu_si128((block *)(out + 16 * j), in[j]);
+  }
+}
+
+// Half-tree hash H(x) = AES-MMO(sigma(x)) with the linear orthomorphism
+// sigma(xL || xR) = (xL ^ xR || xL); this is circular correlation robust,
+// which is what lets both children come from one call (Guo et al.,
+// "Half-Tree", Eurocrypt 2023).
+inline block Sigma(block x) {
+  return _mm_shuffle_epi32(x, 0x4E) ^ (x & _mm_set_epi64x(-1, 0));
+}
+
+inline block HashCR(block x) { return mFixedKeyNI.encryptECB_MMO(Sigma(x)); }
+
+// all-ones if the LSB (half-tree control bit) of in is set
+inline block getLSBMask(block in) {
+  return _mm_shuffle_epi32(_mm_srai_epi32(_mm_slli_epi32(in, 31), 31), 0x00);
+}
+
+inline bool getLSB(block in) { return !is_zero(in & LSBBlock); }
+
+// Half-tree leaf: block j is H(s ^ j), corrected when the LSB of s is set.
+static void ConvertLeafHalfTree(block s, size_t leaf_log,
+                                const block *finalCW, uint8_t *out) {
+  const size_t B = 1ULL << leaf_log;
+  block in[1ULL << kMaxLeafLog];
+  for (size_t j = 0; j < B; j++)
+    in[j] = Sigma(s ^ LeafCtr(j));
+  mFixedKeyNI.encryptECB_MMO_Blocks(in, B, in);
+  for (size_t j = 0; j < B; j++) {
+    if (getLSB(s))
+      in[j] ^= finalCW[j];
+    _mm_storeu_si128((block *)(out + 16 * j), in[j]);
+  }
+}
+
+static bool EvalHalfTree(const Key &key, size_t x, size_t logn) {
+  const size_t leaf_log = key.leaf_log;
+  size_t stop = TreeStop(logn, leaf_log);
+  assert(key.depth == stop);
+  block s = key.seed;
   for (size_t i = 0; i < stop; i++) {
-    Log::v("gen", "%d, %d", t0, t1);
-    Log::v("gen", s0);
-    Log::v("gen", s1);
-
-    block s0L = prg::getL(s0);
-    uint8_t t0L = getT(s0L);
-    s0L = clr(s0L);
-    block s0R = prg::getR(s0);
-    uint8_t t0R = getT(s0R);
-    s0R = clr(s0R);
-
-    block s1L = prg::getL(s1);
-    uint8_t t1L = getT(s1L);
-    s1L = clr(s1L);
-    block s1R = prg::getR(s1);
-    uint8_t t1R = getT(s1R);
-    s1R = clr(s1R);
-
-    if (alpha & (1ULL << (logn - 1 - i))) {
-      // KEEP = R, LOSE = L
-      block scw = s0L ^ s1L;
-      uint8_t tLCW = t0L ^ t1L;
-      uint8_t tRCW = t0R ^ t1R ^ 1;
-      CW.insert(CW.end(), (uint8_t *)&scw, ((uint8_t *)&scw) + sizeof(scw));
-      CW.push_back(tLCW);
-      CW.push_back(tRCW);
-
-      s0 = s0R;
-      if (t0)
-        s0 = s0 ^ scw;
-      s1 = s1R;
-      if (t1)
-        s1 = s1 ^ scw;
-      // new t
-      if (t0)
-        t0 = t0R ^ tRCW;
-      else
-        t0 = t0R;
-      if (t1)
-        t1 = t1R ^ tRCW;
-      else
-        t1 = t1R;
+    block cw = key.cw[i];
+    block l = HashCR(s) ^ (cw & getLSBMask(s));
+    s = (x & (1ULL << (logn - 1 - i))) ? l ^ s : l;
+  }
+  uint8_t leaf[16ULL << kMaxLeafLog];
+  ConvertLeafHalfTree(s, leaf_log, key.final, leaf);
+  const size_t pos = x & ((128ULL << leaf_log) - 1);
+  return (leaf[pos / 8] >> (pos % 8)) & 1;
+}
+
+static void EvalFullRecursiveHalfTree(const Key &key,
+                                      block s, size_t lvl, size_t stop,
+                                      size_t limit, std::vector<uint8_t> &res) {
+  if (res.size() >= limit)
+    return;
+  if (lvl == stop) {
+    uint8_t tmp[16ULL << kMaxLeafLog];
+    const size_t leaf_log = key.leaf_log;
+    ConvertLeafHalfTree(s, leaf_log, key.final, tmp);
+    res.insert(res.end(), tmp, tmp + (16ULL << leaf_log));
+    return;
+  }
+  block cw = key.cw[lvl];
+  block l = HashCR(s) ^ (cw & getLSBMask(s));
+  EvalFullRecursiveHalfTree(key, l, lvl + 1, stop, limit, res);
+  EvalFullRecursiveHalfTree(key, l ^ s, lvl + 1, stop, limit, res);
+}
+
+// GGM4 child j of a seed is AES-MMO(s ^ j * 2^64): the counter sits in the
+// high half, clear of the control bit in the MSB and of the leaf counters.
+inline block QuadTweak(size_t j) { return _mm_set_epi64x(j, 0); }
+
+inline block QuadChild(block s, size_t j) {
+  return mFixedKeyNI.encryptECB_MMO(clr(s) ^ QuadTweak(j));
+}
+
+// CW of child j of the GGM4 node pair starting at level lvl, its tCW
+// folded into the MSB.
+static block QuadCW(const Key &key, size_t lvl, size_t j) {
+  const size_t i = lvl + (j & 1);
+  const block s = j < 2 ? key.cw[i] : key.cw_hi[i];
+  return ((j < 2 ? key.tL : key.tR) >> i) & 1 ? s | MSBBlock : s;
+}
+
+// GGM4 seeds carry their control bit in the MSB throughout.
+static bool EvalQuad(const Key &key, size_t x, size_t logn) {
+  const size_t leaf_log = key.leaf_log;
+  size_t stop = TreeStop(logn, leaf_log);
+  assert(key.depth == stop);
+  block s = key.t ? key.seed | MSBBlock : key.seed;
+  for (size_t i = 0; i < stop; i += 2) {
+    const size_t j = (x >> (logn - 2 - i)) & 3;
+    s = QuadChild(s, j) ^ (QuadCW(key, i, j) & getTMask(s));
+  }
+  const size_t j = (x >> 7) & ((1ULL << leaf_log) - 1);
+  reg_arr_union tmp;
+  tmp.reg = ConvertBlock(clr(s) ^ LeafCtr(j));
+  if (getT(s))
+    tmp.reg = key.final[j] ^ tmp.reg;
+  return (tmp.arr[(x & 127) / 8] & (1UL << ((x & 127) % 8))) != 0;
+}
+
+static void EvalFullRecursiveQuad(const Key &key, block s, size_t lvl,
+                                  size_t stop, size_t limit,
+                                  std::vector<uint8_t> &res) {
+  if (res.size() >= limit)
+    return;
+  if (lvl == stop) {
+    uint8_t tmp[16ULL << kMaxLeafLog];
+    const size_t leaf_log = key.leaf_log;
+    ConvertLeaf(clr(s), getT(s), leaf_log, key.final, tmp);
+    res.insert(res.end(), tmp, tmp + (16ULL << leaf_log));
+    return;
+  }
+  for (size_t j = 0; j < 4; j++)
+    EvalFullRecursiveQuad(key, QuadChild(s, j) ^ (QuadCW(key, lvl, j) & getTMask(s)),
+                          lvl + 2, stop, limit, res);
+}
+
+size_t KeyLeafLog(const Key &key) { return key.leaf_log; }
+
+Scheme KeyScheme(const Key &key) { return key.scheme; }
+
+typedef std::pair<std::vector<uint8_t>, std::vector<uint8_t>> KeyPair;
+
+// Keys generated together by GenBatch; all 2 * kGenKeys seeds of a level
+// are hashed in one wide AES call.
+static const size_t kGenKeys = 8;
+
+static void AppendBlock(std::vector<uint8_t> &v, const block &b) {
+  v.insert(v.end(), (const uint8_t *)&b, ((const uint8_t *)&b) + sizeof(b));
+}
+
+// Left and right children of n seeds, 8 at a time.
+static void getLRBlocks(const block *s, size_t n, block *L, block *R) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    prg::getLR<8>(s + i, L + i, R + i);
+  for (; i < n; i++)
+    prg::getLR<1>(s + i, L + i, R + i);
+}
+
+// Keys for alphas[0..K), K <= kGenKeys, level by level. Seed 2k is key k's
+// first server, 2k + 1 its second. Each key draws its two root values from
+// p in turn, so K = 1 reproduces the keys Gen has always produced.
+//
+// GGM: both children of both seeds come from the two fixed-key hashes, and
+// the CW cancels the off-path child while keeping the t bits apart.
+//
+// Half-tree: the seeds differ by a secret delta with LSB 1 on the path to
+// alpha and are equal off it. Each node costs one hash: the left child is
+// H(s) ^ t * CW and the right child is the left child ^ s, so
+// CW = H(s0) ^ H(s1) ^ (1 - alpha_i) * delta keeps the delta on the alpha
+// side only.
+//
+// GGM4: each pair of levels is one 4-ary level. The four children of both
+// seeds come from one hash call each; the CWs cancel the three off-path
+// children and a fresh random sCW hides which child is kept.
+static void GenGroup(const size_t *alphas, size_t K, size_t logn,
+                     size_t leaf_log, Scheme scheme, size_t domain, PRNG &p,
+                     KeyPair *keys) {
+  assert(K <= kGenKeys);
+  const bool half = scheme == Scheme::HalfTree;
+  const bool quad = scheme == Scheme::GGM4;
+  const size_t stop = TreeStop(logn, leaf_log);
+  assert(!quad || stop % 2 == 0);
+  const size_t B = 1ULL << leaf_log;
+  block s[2 * kGenKeys], delta[kGenKeys];
+  uint8_t t[2 * kGenKeys];
+  std::vector<uint8_t> CW[kGenKeys];
+
+  for (size_t k = 0; k < K; k++) {
+    std::vector<uint8_t> &ka = keys[k].first, &kb = keys[k].second;
+    ka.clear();
+    kb.clear();
+    PushHeader(ka, leaf_log, scheme, domain);
+    PushHeader(kb, leaf_log, scheme, domain);
+    block &s0 = s[2 * k], &s1 = s[2 * k + 1];
+    p.get((uint8_t *)&s0, sizeof(s0));
+    if (half) {
+      p.get((uint8_t *)&delta[k], sizeof(delta[k]));
+      delta[k] = delta[k] | LSBBlock;
+      s1 = s0 ^ delta[k];
+      AppendBlock(ka, s0);
+      AppendBlock(kb, s1);
     } else {
-      // KEEP = L, LOSE = R
-      block scw = s0R ^ s1R;
-      uint8_t tLCW = t0L ^ t1L ^ 1;
-      uint8_t tRCW = t0R ^ t1R;
-      CW.insert(CW.end(), (uint8_t *)&scw, ((uint8_t *)&scw) + sizeof(scw));
-      CW.push_back(tLCW);
-      CW.push_back(tRCW);
-      // new s
-      s0 = s0L;
-      if (t0)
-        s0 = s0 ^ scw;
-      s1 = s1L;
-      if (t1)
-        s1 = s1 ^ scw;
-      // new t
-      if (t0)
-        t0 = t0L ^ tLCW;
-      else
-        t0 = t0L;
-      if (t1)
-        t1 = t1L ^ tLCW;
-      else
-        t1 = t1L;
-    }
-  }
-  reg_arr_union tmp = {ZeroBlock};
-  tmp.arr[(alpha & 127) / 8] = (uint8_t)(1U << ((alpha & 127) % 8));
-  tmp.reg = tmp.reg ^ ConvertBlock(s0) ^ ConvertBlock(s1);
-  CW.insert(CW.end(), (uint8_t *)&tmp.reg,
-            ((uint8_t *)&tmp.reg) + sizeof(tmp.reg));
-  ka.insert(ka.end(), CW.begin(), CW.end());
-  kb.insert(kb.end(), CW.begin(), CW.end());
-
-  return std::make_pair(ka, kb);
-}
-
-bool Eval(const std::vector<uint8_t> &key, size_t x, size_t logn) {
+      p.get((uint8_t *)&s1, sizeof(s1));
+      t[2 * k] = getT(s0);
+      t[2 * k + 1] = !t[2 * k];
+      s0 = clr(s0);
+      s1 = clr(s1);
+      AppendBlock(ka, s0);
+      ka.push_back(t[2 * k]);
+      AppendBlock(kb, s1);
+      kb.push_back(t[2 * k + 1]);
+    }
+    CW[k].clear();
+    CW[k].reserve((half ? 16 : quad ? 34 : 18) * stop + 16 * B);
+  }
+
+  block L[2 * kGenKeys], R[2 * kGenKeys];
+  for (size_t i = 0; i < stop && quad; i += 2) {
+    block c[8 * kGenKeys];
+    for (size_t j = 0; j < 8 * K; j++)
+      c[j] = s[j / 4] ^ QuadTweak(j & 3);
+    mFixedKeyNI.encryptECB_MMO_Blocks(c, 8 * K, c);
+    for (size_t k = 0; k < K; k++) {
+      const size_t keep = (alphas[k] >> (logn - 2 - i)) & 3;
+      const block *c0 = &c[8 * k], *c1 = &c[8 * k + 4];
+      block scw[4];
+      uint8_t tcw[4];
+      for (size_t j = 0; j < 4; j++) {
+        if (j == keep) {
+          p.get((uint8_t *)&scw[j], sizeof(scw[j]));
+          scw[j] = clr(scw[j]);
+        } else {
+          scw[j] = clr(c0[j]) ^ clr(c1[j]);
+        }
+        tcw[j] = getT(c0[j]) ^ getT(c1[j]) ^ (j == keep);
+        AppendBlock(CW[k], scw[j]);
+      }
+      CW[k].insert(CW[k].end(), tcw, tcw + 4);
+      for (size_t j : {2 * k, 2 * k + 1}) {
+        const block kept = c[4 * j + keep];
+        s[j] = t[j] ? clr(kept) ^ scw[keep] : clr(kept);
+        t[j] = getT(kept) ^ (t[j] & tcw[keep]);
+      }
+    }
+  }
+  for (size_t i = 0; i < stop && !quad; i++) {
+    const size_t bit = 1ULL << (logn - 1 - i);
+    if (half) {
+      for (size_t j = 0; j < 2 * K; j++)
+        L[j] = Sigma(s[j]);
+      mFixedKeyNI.encryptECB_MMO_Blocks(L, 2 * K, L);
+      for (size_t k = 0; k < K; k++) {
+        block &s0 = s[2 * k], &s1 = s[2 * k + 1];
+        const bool right = alphas[k] & bit;
+        block cw = L[2 * k] ^ L[2 * k + 1];
+        if (!right)
+          cw = cw ^ delta[k];
+        AppendBlock(CW[k], cw);
+        block l0 = L[2 * k] ^ (cw & getLSBMask(s0));
+        block l1 = L[2 * k + 1] ^ (cw & getLSBMask(s1));
+        s0 = right ? l0 ^ s0 : l0;
+        s1 = right ? l1 ^ s1 : l1;
+      }
+      continue;
+    }
+    getLRBlocks(s, 2 * K, L, R);
+    for (size_t k = 0; k < K; k++) {
+      const bool right = alphas[k] & bit;
+      const size_t a = 2 * k, b = 2 * k + 1;
+      // KEEP the child on the path to alpha, LOSE the other one
+      block sL0 = clr(L[a]), sL1 = clr(L[b]), sR0 = clr(R[a]), sR1 = clr(R[b]);
+      uint8_t tL0 = getT(L[a]), tL1 = getT(L[b]);
+      uint8_t tR0 = getT(R[a]), tR1 = getT(R[b]);
+      block scw = right ? sL0 ^ sL1 : sR0 ^ sR1;
+      uint8_t tLCW = tL0 ^ tL1 ^ !right;
+      uint8_t tRCW = tR0 ^ tR1 ^ right;
+      AppendBlock(CW[k], scw);
+      CW[k].push_back(tLCW);
+      CW[k].push_back(tRCW);
+
+      const uint8_t tKeep = right ? tRCW : tLCW;
+      for (size_t j : {a, b}) {
+        block keep = right ? clr(R[j]) : clr(L[j]);
+        uint8_t tk = right ? getT(R[j]) : getT(L[j]);
+        if (t[j])
+          keep = keep ^ scw;
+        t[j] = tk ^ (t[j] & tKeep);
+        s[j] = keep;
+      }
+    }
+  }
+
+  // one final CW block per leaf block; only the one holding alpha has a 1
+  block leaf[2 * kGenKeys << kMaxLeafLog];
+  for (size_t j = 0; j < 2 * K; j++)
+    for (size_t c = 0; c < B; c++)
+      leaf[j * B + c] = half ? Sigma(s[j] ^ LeafCtr(c)) : s[j] ^ LeafCtr(c);
+  if (half)
+    mFixedKeyNI.encryptECB_MMO_Blocks(leaf, 2 * K * B, leaf);
+  else
+    mFixedKeyNI.encryptECBBlocks(leaf, 2 * K * B, leaf);
+  for (size_t k = 0; k < K; k++) {
+    const size_t pos = alphas[k] & ((128ULL << leaf_log) - 1);
+    for (size_t c = 0; c < B; c++) {
+      reg_arr_union tmp = {ZeroBlock};
+      if (pos / 128 == c)
+        tmp.arr[(pos & 127) / 8] = (uint8_t)(1U << ((pos & 127) % 8));
+      tmp.reg = tmp.reg ^ leaf[2 * k * B + c] ^ leaf[(2 * k + 1) * B + c];
+      AppendBlock(CW[k], tmp.reg);
+    }
+    keys[k].first.insert(keys[k].first.end(), CW[k].begin(), CW[k].end());
+    keys[k].second.insert(keys[k].second.end(), CW[k].begin(), CW[k].end());
+  }
+}
+
+// Shared argument checks of Gen and GenBatch; returns the leaf packing
+// actually used and normalises a full domain to 0.
+static size_t CheckGenArgs(size_t logn, size_t leaf_log, Scheme scheme,
+                           size_t &domain) {
+  assert(logn <= 63);
+  assert(domain <= (1ULL << logn));
+  if (domain == (1ULL << logn))
+    domain = 0;
+  assert(leaf_log <= kMaxLeafLog);
+  const size_t max_log = std::min(kMaxLeafLog, logn >= 7 ? logn - 7 : 0);
+  leaf_log = std::min(leaf_log, max_log);
+  // a GGM4 tree takes two levels per step: an odd level goes into the leaf
+  if (scheme == Scheme::GGM4 && TreeStop(logn, leaf_log) % 2)
+    leaf_log = leaf_log < max_log ? leaf_log + 1 : leaf_log - 1;
+  return leaf_log;
+}
+
+// One generator per thread, keyed once from the OS entropy source.
+static PRNG &ThreadPRNG() {
+  thread_local PRNG prng([] {
+    std::random_device rd;
+    return _mm_set_epi32(rd(), rd(), rd(), rd());
+  }());
+  return prng;
+}
+
+static bool g_testSeed = false;
+
+void SetTestSeed(bool enable) { g_testSeed = enable; }
+
+KeyPair Gen(size_t alpha, size_t logn, size_t leaf_log, Scheme scheme,
+            size_t domain) {
+  leaf_log = CheckGenArgs(logn, leaf_log, scheme, domain);
+  assert(alpha < (domain ? domain : 1ULL << logn));
+  KeyPair keys;
+  if (g_testSeed) {
+    PRNG p = PRNG::getTestPRNG();
+    GenGroup(&alpha, 1, logn, leaf_log, scheme, domain, p, &keys);
+  } else {
+    GenGroup(&alpha, 1, logn, leaf_log, scheme, domain, ThreadPRNG(), &keys);
+  }
+  return keys;
+}
+
+std::vector<KeyPair> GenBatch(const std::vector<size_t> &alphas, size_t logn,
+                              size_t leaf_log, Scheme scheme, size_t domain,
+                              size_t threads) {
+  leaf_log = CheckGenArgs(logn, leaf_log, scheme, domain);
+  for (size_t alpha : alphas)
+    assert(alpha < (domain ? domain : 1ULL << logn));
+  if (threads == 0)
+    threads = omp_get_max_threads();
+  std::vector<KeyPair> keys(alphas.size());
+  const size_t groups = (alphas.size() + kGenKeys - 1) / kGenKeys;
+#pragma omp parallel for schedule(static) num_threads(threads)
+  for (size_t g = 0; g < groups; g++) {
+    const size_t first = g * kGenKeys;
+    const size_t count = std::min(kGenKeys, alphas.size() - first);
+    if (g_testSeed) {
+      // one fixed stream per group, whichever thread runs it
+      PRNG p(_mm_xor_si128(TestBlock, _mm_set_epi64x(0, (int64_t)g)));
+      GenGroup(&alphas[first], count, logn, leaf_log, scheme, domain, p,
+               &keys[first]);
+    } else {
+      GenGroup(&alphas[first], count, logn, leaf_log, scheme, domain,
+               ThreadPRNG(), &keys[first]);
+    }
+  }
+  return keys;
+}
+
+bool Eval(const Key &key, size_t x, size_t logn) {
   assert(logn <= 63);
-  assert(x < (1ULL << logn));
-  block s;
-  memcpy(&s, key.data(), 16);
-  uint8_t t = key.data()[16];
-  size_t stop = logn >= 7 ? logn - 7 : 0; // pack 7 layers in final CW
+  assert(x < (key.domain ? key.domain : 1ULL << logn));
+  if (key.scheme == Scheme::HalfTree)
+    return EvalHalfTree(key, x, logn);
+  if (key.scheme == Scheme::GGM4)
+    return EvalQuad(key, x, logn);
+  block s = key.seed;
+  uint8_t t = key.t;
+  const size_t leaf_log = key.leaf_log;
+  size_t stop = TreeStop(logn, leaf_log);
+  assert(key.depth == stop);
   for (size_t i = 0; i < stop; i++) {
     Log::v("eval", s);
     Log::v("eval", "t: %d", t);
@@ -171,10 +633,9 @@ bool Eval(const std::vector<uint8_t> &key, size_t x, size_t logn) {
     uint8_t tR = getT(sR);
     sR = clr(sR);
     if (t) {
-      block sCW;
-      memcpy(&sCW, key.data() + 17 + i * 18, 16);
-      uint8_t tLCW = key.data()[17 + i * 18 + 16];
-      uint8_t tRCW = key.data()[17 + i * 18 + 17];
+      block sCW = key.cw[i];
+      uint8_t tLCW = (key.tL >> i) & 1;
+      uint8_t tRCW = (key.tR >> i) & 1;
       Log::v("eval", "tcw %d %d", tLCW, tRCW);
       tL ^= tLCW;
       tR ^= tRCW;
@@ -190,34 +651,127 @@ bool Eval(const std::vector<uint8_t> &key, size_t x, size_t logn) {
     }
   }
   Log::v("evalfin", s);
-  if (t) {
-    reg_arr_union tmp;
-    reg_arr_union CW;
-    memcpy(CW.arr, key.data() + key.size() - 16, 16);
-    tmp.reg = CW.reg ^ ConvertBlock(s);
-    return (tmp.arr[(x & 127) / 8] & (1UL << ((x & 127) % 8))) != 0;
-  } else {
-    reg_arr_union tmp;
-    tmp.reg = ConvertBlock(s);
-    return (tmp.arr[(x & 127) / 8] & (1UL << ((x & 127) % 8))) != 0;
+  // only the leaf block holding x is converted
+  const size_t j = (x >> 7) & ((1ULL << leaf_log) - 1);
+  reg_arr_union tmp;
+  tmp.reg = ConvertBlock(s ^ LeafCtr(j));
+  if (t)
+    tmp.reg = key.final[j] ^ tmp.reg;
+  return (tmp.arr[(x & 127) / 8] & (1UL << ((x & 127) % 8))) != 0;
+}
+
+// Leaf conversions queued by EvalPoints and run 8 per AES call.
+struct PointLeafQueue {
+  const Key &key;
+  std::vector<uint8_t> &res;
+  size_t n = 0;
+  block in[8];
+  bool corr[8];
+  uint8_t j[8], bit[8];
+  size_t idx[8];
+
+  void push(block s, bool c, size_t blk, size_t b, size_t i) {
+    block x = s ^ LeafCtr(blk);
+    in[n] = key.scheme == Scheme::HalfTree ? Sigma(x) : x;
+    corr[n] = c;
+    j[n] = (uint8_t)blk;
+    bit[n] = (uint8_t)b;
+    idx[n] = i;
+    if (++n == 8)
+      flush();
+  }
+
+  void flush() {
+    const bool half = key.scheme == Scheme::HalfTree;
+    reg_arr_union out[8];
+    if (n == 8 && half)
+      mFixedKeyNI.encryptECB_MMO8(in, (block *)out);
+    else if (n == 8)
+      mFixedKeyNI.encryptECB8(in, (block *)out);
+    for (size_t k = 0; k < n; k++) {
+      if (n < 8)
+        out[k].reg = half ? mFixedKeyNI.encryptECB_MMO(in[k])
+                          : mFixedKeyNI.encryptECB(in[k]);
+      if (corr[k])
+        out[k].reg = out[k].reg ^ key.final[j[k]];
+      res[idx[k]] = (out[k].arr[bit[k] / 8] >> (bit[k] % 8)) & 1;
+    }
+    n = 0;
+  }
+};
+
+std::vector<uint8_t> EvalPoints(const Key &key, const std::vector<size_t> &xs,
+                                size_t logn) {
+  assert(logn <= 63);
+  const bool half = key.scheme == Scheme::HalfTree;
+  const bool quad = key.scheme == Scheme::GGM4;
+  const size_t step = quad ? 2 : 1;
+  const size_t leaf_log = key.leaf_log;
+  const size_t stop = TreeStop(logn, leaf_log);
+  assert(key.depth == stop);
+  const size_t shift = logn - stop;
+  std::vector<uint8_t> res(xs.size());
+  PointLeafQueue queue{key, res};
+
+  // path[d] is the seed at depth d on the way to the previous point; GGM
+  // seeds carry their control bit in the MSB, as in the BFS evaluators.
+  block path[Key::kMaxDepth + 1];
+  path[0] = half || !key.t ? key.seed : key.seed | MSBBlock;
+  size_t prev = 0, valid = 0;
+  for (size_t i = 0; i < xs.size(); i++) {
+    const size_t x = xs[i];
+    assert(x < (key.domain ? key.domain : 1ULL << logn));
+    const size_t leaf = x >> shift;
+    // levels above the highest bit where this leaf index differs from the
+    // previous one are already on the path (GGM4: whole 4-ary levels)
+    if (i > 0 && leaf != prev) {
+      valid = stop - 1 - (63 - __builtin_clzll(leaf ^ prev));
+      valid -= valid % step;
+    }
+    for (size_t d = valid; d < stop; d += step) {
+      const bool right = (leaf >> (stop - 1 - d)) & 1;
+      const block s = path[d];
+      if (quad) {
+        const size_t j = (leaf >> (stop - 2 - d)) & 3;
+        path[d + 2] = QuadChild(s, j) ^ (QuadCW(key, d, j) & getTMask(s));
+      } else if (half) {
+        block l = HashCR(s) ^ (key.cw[d] & getLSBMask(s));
+        path[d + 1] = right ? l ^ s : l;
+      } else {
+        // only the child on the path is hashed; the t correction goes
+        // into the MSB with the seed correction
+        block cw = key.cw[d];
+        if ((right ? key.tR : key.tL) >> d & 1)
+          cw = cw | MSBBlock;
+        block c = right ? prg::getR(clr(s)) : prg::getL(clr(s));
+        path[d + 1] = c ^ (cw & getTMask(s));
+      }
+    }
+    valid = stop;
+    prev = leaf;
+    const block s = path[stop];
+    const size_t blk = (x >> 7) & ((1ULL << leaf_log) - 1);
+    if (half)
+      queue.push(s, getLSB(s), blk, x & 127, i);
+    else
+      queue.push(clr(s), getT(s), blk, x & 127, i);
   }
+  queue.flush();
+  return res;
 }
 
-void EvalFullRecursive(const std::vector<uint8_t> &key, block s, uint8_t t,
-                       size_t lvl, size_t stop, std::vector<uint8_t> &res) {
-                        
+// Leaves are appended in order, so once res holds limit bytes every
+// remaining subtree lies past the domain and is skipped.
+void EvalFullRecursive(const Key &key, block s, uint8_t t,
+                       size_t lvl, size_t stop, size_t limit,
+                       std::vector<uint8_t> &res) {
+  if (res.size() >= limit)
+    return;
   if (lvl == stop) {
-    if (t) {
-      reg_arr_union tmp;
-      reg_arr_union CW;
-      memcpy(CW.arr, key.data() + key.size() - 16, 16);
-      tmp.reg = CW.reg ^ ConvertBlock(s);
-      res.insert(res.end(), &tmp.arr[0], &tmp.arr[16]);
-    } else {
-      reg_arr_union tmp;
-      tmp.reg = ConvertBlock(s);
-      res.insert(res.end(), &tmp.arr[0], &tmp.arr[16]);
-    }
+    uint8_t tmp[16ULL << kMaxLeafLog];
+    const size_t leaf_log = key.leaf_log;
+    ConvertLeaf(s, t, leaf_log, key.final, tmp);
+    res.insert(res.end(), tmp, tmp + (16ULL << leaf_log));
     return;
   }
   block sL = prg::getL(s);
@@ -227,48 +781,60 @@ void EvalFullRecursive(const std::vector<uint8_t> &key, block s, uint8_t t,
   uint8_t tR = getT(sR);
   sR = clr(sR);
   if (t) {
-    block sCW;
-    memcpy(&sCW, key.data() + 17 + lvl * 18, 16);
-    uint8_t tLCW = key.data()[17 + lvl * 18 + 16];
-    uint8_t tRCW = key.data()[17 + lvl * 18 + 17];
+    block sCW = key.cw[lvl];
+    uint8_t tLCW = (key.tL >> lvl) & 1;
+    uint8_t tRCW = (key.tR >> lvl) & 1;
     tL ^= tLCW;
     tR ^= tRCW;
     sL ^= sCW;
     sR ^= sCW;
   }
-  Log::v("-sL", sL);
-  EvalFullRecursive(key, sL, tL, lvl + 1, stop, res);
-  Log::v("-sR", sR);
-  EvalFullRecursive(key, sR, tR, lvl + 1, stop, res);
+  EvalFullRecursive(key, sL, tL, lvl + 1, stop, limit, res);
+  EvalFullRecursive(key, sR, tR, lvl + 1, stop, limit, res);
 }
 
-std::vector<uint8_t> EvalFull(const std::vector<uint8_t> &key, size_t logn) {
+std::vector<uint8_t> EvalFull(const Key &key, size_t logn) {
 
   assert(logn <= 63);
+  const size_t bytes = EvalFullSize(key, logn);
   std::vector<uint8_t> data;
-  if (logn >= 7)
-    data.reserve(1ULL << (logn - 3));
-  block s;
-  memcpy(&s, key.data(), 16);
-  uint8_t t = key.data()[16];
-  size_t stop = logn >= 7 ? logn - 7 : 0; // pack 7 layers in final CW
-  EvalFullRecursive(key, s, t, 0, stop, data);
+  data.reserve(bytes + (16ULL << key.leaf_log));
+  size_t stop = TreeStop(logn, key.leaf_log);
+  assert(key.depth == stop);
+  if (key.scheme == Scheme::HalfTree) {
+    EvalFullRecursiveHalfTree(key, key.seed, 0, stop, bytes, data);
+  } else if (key.scheme == Scheme::GGM4) {
+    EvalFullRecursiveQuad(key, key.t ? key.seed | MSBBlock : key.seed, 0,
+                          stop, bytes, data);
+  } else {
+    block s = key.seed;
+    uint8_t t = key.t;
+    EvalFullRecursive(key, s, t, 0, stop, bytes, data);
+  }
+  data.resize(bytes);
+  data[bytes - 1] &= TailMask(key);
   return data;
 }
 
 // optimized for vectorized ops
-void EvalFullRecursive8(const std::vector<uint8_t> &key,
+void EvalFullRecursive8(const Key &key,
                         std::array<block, 8> &s, std::array<uint8_t, 8> &t,
                         size_t lvl, size_t stop,
                         std::array<uint8_t *, 8> &res) {
+  if (lvl == stop && key.leaf_log > 0) {
+    const size_t leaf_log = key.leaf_log;
+    for (int i = 0; i < 8; i++) {
+      ConvertLeaf(s[i], t[i], leaf_log, key.final, res[i]);
+      res[i] += 16ULL << leaf_log;
+    }
+    return;
+  }
   if (lvl == stop) {
     std::array<reg_arr_union, 8> tmp;
-    reg_arr_union CW;
-    memcpy(CW.arr, key.data() + key.size() - 16, 16);
     std::array<block, 8> conv = ConvertBlock8(s);
     for (int i = 0; i < 8; i++) {
       block tt = _mm_set1_epi8(-(t[i]));
-      tmp[i].reg = conv[i] ^ (CW.reg & tt);
+      tmp[i].reg = conv[i] ^ (key.final[0] & tt);
       memcpy(res[i], tmp[i].arr, 16);
       res[i] += sizeof(block);
     }
@@ -280,10 +846,9 @@ void EvalFullRecursive8(const std::vector<uint8_t> &key,
   std::array<block, 8> sR = prg::getR8(s);
   std::array<uint8_t, 8> tR = getT8(sR);
   clr8(sR);
-  block sCW;
-  memcpy(&sCW, key.data() + 17 + lvl * 18, 16);
-  uint8_t tLCW = key.data()[17 + lvl * 18 + 16];
-  uint8_t tRCW = key.data()[17 + lvl * 18 + 17];
+  block sCW = key.cw[lvl];
+  uint8_t tLCW = (key.tL >> lvl) & 1;
+  uint8_t tRCW = (key.tR >> lvl) & 1;
   for (int i = 0; i < 8; i++) {
     tL[i] ^= (tLCW & t[i]);
     tR[i] ^= (tRCW & t[i]);
@@ -295,19 +860,39 @@ void EvalFullRecursive8(const std::vector<uint8_t> &key,
   EvalFullRecursive8(key, sR, tR, lvl + 1, stop, res);
 }
 
-std::vector<uint8_t> EvalFull8(const std::vector<uint8_t> &key, size_t logn) {
+// 2^logn bits whatever the leaf packing, but at least one block
+size_t EvalFullSize(size_t logn) { return 16ULL << TreeStop(logn, 0); }
+
+size_t EvalFullSize(const Key &key, size_t logn) {
+  assert(key.domain <= (1ULL << logn));
+  return key.domain ? (key.domain + 7) / 8 : EvalFullSize(logn);
+}
+
+std::vector<uint8_t> EvalFull8(const Key &key, size_t logn) {
+  std::vector<uint8_t> data(EvalFullSize(key, logn));
+  EvalFull8Into(key, logn, data);
+  return data;
+}
+
+void EvalFull8Into(const Key &key, size_t logn,
+                   span<uint8_t> out) {
 
   assert(logn <= 63);
-  std::vector<uint8_t> data;
-  data.resize(1ULL << (logn - 3));
+  assert((size_t)out.size() >= EvalFullSize(key, logn));
+  // the unrolled top levels below are binary-GGM-specific and expand the
+  // whole domain; the breadth-first evaluator prunes truncated ones
+  if (key.scheme != Scheme::GGM || key.domain) {
+    EvalFullInto(key, logn, out);
+    return;
+  }
   std::array<uint8_t *, 8> data_ptrs;
   for (size_t i = 0; i < 8; i++) {
-    data_ptrs[i] = &data[i * (1ULL << (logn - 3 - 3))];
+    data_ptrs[i] = out.data() + i * (1ULL << (logn - 3 - 3));
   }
-  block s;
-  memcpy(&s, key.data(), 16);
-  uint8_t t = key.data()[16];
-  size_t stop = logn >= 7 ? logn - 7 : 0; // pack 7 layers in final CW
+  block s = key.seed;
+  uint8_t t = key.t;
+  size_t stop = TreeStop(logn, key.leaf_log);
+  assert(key.depth == stop);
   assert(stop >= 3); // need 3 or more layers for this to make sense
   // evaluate first 3 layers
   size_t lvl = 0;
@@ -318,10 +903,9 @@ std::vector<uint8_t> EvalFull8(const std::vector<uint8_t> &key, size_t logn) {
   uint8_t tR = getT(sR);
   sR = clr(sR);
   if (t) {
-    block sCW;
-    memcpy(&sCW, key.data() + 17 + lvl * 18, 16);
-    uint8_t tLCW = key.data()[17 + lvl * 18 + 16];
-    uint8_t tRCW = key.data()[17 + lvl * 18 + 17];
+    block sCW = key.cw[lvl];
+    uint8_t tLCW = (key.tL >> lvl) & 1;
+    uint8_t tRCW = (key.tR >> lvl) & 1;
     tL ^= tLCW;
     tR ^= tRCW;
     sL ^= sCW;
@@ -336,10 +920,9 @@ std::vector<uint8_t> EvalFull8(const std::vector<uint8_t> &key, size_t logn) {
   uint8_t tRL = getT(sRL);
   sRL = clr(sRL);
   if (tL) {
-    block sCW;
-    memcpy(&sCW, key.data() + 17 + lvl * 18, 16);
-    uint8_t tLCW = key.data()[17 + lvl * 18 + 16];
-    uint8_t tRCW = key.data()[17 + lvl * 18 + 17];
+    block sCW = key.cw[lvl];
+    uint8_t tLCW = (key.tL >> lvl) & 1;
+    uint8_t tRCW = (key.tR >> lvl) & 1;
     tLL ^= tLCW;
     tRL ^= tRCW;
     sLL ^= sCW;
@@ -352,10 +935,9 @@ std::vector<uint8_t> EvalFull8(const std::vector<uint8_t> &key, size_t logn) {
   uint8_t tRR = getT(sRR);
   sRR = clr(sRR);
   if (tR) {
-    block sCW;
-    memcpy(&sCW, key.data() + 17 + lvl * 18, 16);
-    uint8_t tLCW = key.data()[17 + lvl * 18 + 16];
-    uint8_t tRCW = key.data()[17 + lvl * 18 + 17];
+    block sCW = key.cw[lvl];
+    uint8_t tLCW = (key.tL >> lvl) & 1;
+    uint8_t tRCW = (key.tR >> lvl) & 1;
     tLR ^= tLCW;
     tRR ^= tRCW;
     sLR ^= sCW;
@@ -370,10 +952,9 @@ std::vector<uint8_t> EvalFull8(const std::vector<uint8_t> &key, size_t logn) {
   uint8_t tRLL = getT(sRLL);
   sRLL = clr(sRLL);
   if (tLL) {
-    block sCW;
-    memcpy(&sCW, key.data() + 17 + lvl * 18, 16);
-    uint8_t tLCW = key.data()[17 + lvl * 18 + 16];
-    uint8_t tRCW = key.data()[17 + lvl * 18 + 17];
+    block sCW = key.cw[lvl];
+    uint8_t tLCW = (key.tL >> lvl) & 1;
+    uint8_t tRCW = (key.tR >> lvl) & 1;
     tLLL ^= tLCW;
     tRLL ^= tRCW;
     sLLL ^= sCW;
@@ -386,10 +967,9 @@ std::vector<uint8_t> EvalFull8(const std::vector<uint8_t> &key, size_t logn) {
   uint8_t tRRL = getT(sRRL);
   sRRL = clr(sRRL);
   if (tRL) {
-    block sCW;
-    memcpy(&sCW, key.data() + 17 + lvl * 18, 16);
-    uint8_t tLCW = key.data()[17 + lvl * 18 + 16];
-    uint8_t tRCW = key.data()[17 + lvl * 18 + 17];
+    block sCW = key.cw[lvl];
+    uint8_t tLCW = (key.tL >> lvl) & 1;
+    uint8_t tRCW = (key.tR >> lvl) & 1;
     tLRL ^= tLCW;
     tRRL ^= tRCW;
     sLRL ^= sCW;
@@ -402,10 +982,9 @@ std::vector<uint8_t> EvalFull8(const std::vector<uint8_t> &key, size_t logn) {
   uint8_t tRLR = getT(sRLR);
   sRLR = clr(sRLR);
   if (tLR) {
-    block sCW;
-    memcpy(&sCW, key.data() + 17 + lvl * 18, 16);
-    uint8_t tLCW = key.data()[17 + lvl * 18 + 16];
-    uint8_t tRCW = key.data()[17 + lvl * 18 + 17];
+    block sCW = key.cw[lvl];
+    uint8_t tLCW = (key.tL >> lvl) & 1;
+    uint8_t tRCW = (key.tR >> lvl) & 1;
     tLLR ^= tLCW;
     tRLR ^= tRCW;
     sLLR ^= sCW;
@@ -418,10 +997,9 @@ std::vector<uint8_t> EvalFull8(const std::vector<uint8_t> &key, size_t logn) {
   uint8_t tRRR = getT(sRRR);
   sRRR = clr(sRRR);
   if (tRR) {
-    block sCW;
-    memcpy(&sCW, key.data() + 17 + lvl * 18, 16);
-    uint8_t tLCW = key.data()[17 + lvl * 18 + 16];
-    uint8_t tRCW = key.data()[17 + lvl * 18 + 17];
+    block sCW = key.cw[lvl];
+    uint8_t tLCW = (key.tL >> lvl) & 1;
+    uint8_t tRCW = (key.tR >> lvl) & 1;
     tLRR ^= tLCW;
     tRRR ^= tRCW;
     sLRR ^= sCW;
@@ -432,6 +1010,1032 @@ std::vector<uint8_t> EvalFull8(const std::vector<uint8_t> &key, size_t logn) {
                                  tLLR, tRLR, tLRR, tRRR};
 
   EvalFullRecursive8(key, s_array, t_array, 3, stop, data_ptrs);
+}
+
+// Scheme, final CW and leaf counters of one key for the breadth-first leaf
+// conversion, repeated to 8 entries so leaf block idx uses entry idx & 7.
+struct LeafCW {
+  Scheme scheme;
+  size_t log;
+  block final[8], ctr[8];
+};
+
+// Breadth-first evaluation keeps the control bit of every seed in its MSB
+// (which clr() drops before hashing), and folds tLCW/tRCW into the MSB of
+// per-level correction blocks. Correcting a child is then a single masked
+// XOR and no separate t arrays are carried between levels.
+struct LevelCW {
+  block L[64], R[64];
+  LeafCW leaf;
+};
+
+static LeafCW unpackLeafCW(const Key &key) {
+  LeafCW leaf;
+  leaf.scheme = key.scheme;
+  leaf.log = key.leaf_log;
+  for (size_t j = 0; j < 8; j++) {
+    size_t b = j & ((1ULL << leaf.log) - 1);
+    leaf.final[j] = key.final[b];
+    leaf.ctr[j] = LeafCtr(b);
+  }
+  return leaf;
+}
+
+// root seed with its control bit in the MSB (GGM, GGM4) or LSB (half-tree)
+static block PackedRoot(const Key &key) {
+  block s = key.seed;
+  if (key.scheme == Scheme::HalfTree)
+    return s;
+  return key.t ? (s | MSBBlock) : s;
+}
+
+// Half-tree keys have one CW per level, kept in L. GGM4 keys keep the
+// Key's layout: children 0, 1 of the pair at lvl in L[lvl], L[lvl + 1]
+// and children 2, 3 in R[lvl], R[lvl + 1].
+static LevelCW unpackLevelCW(const Key &key, size_t stop) {
+  LevelCW cw;
+  for (size_t lvl = 0; lvl < stop && key.scheme == Scheme::HalfTree;
+       lvl++) {
+    cw.L[lvl] = key.cw[lvl];
+    cw.R[lvl] = cw.L[lvl];
+  }
+  for (size_t lvl = 0; lvl < stop && key.scheme == Scheme::GGM;
+       lvl++) {
+    block sCW = key.cw[lvl];
+    uint8_t tLCW = (key.tL >> lvl) & 1;
+    uint8_t tRCW = (key.tR >> lvl) & 1;
+    cw.L[lvl] = tLCW ? (sCW | MSBBlock) : sCW;
+    cw.R[lvl] = tRCW ? (sCW | MSBBlock) : sCW;
+  }
+  for (size_t lvl = 0; lvl < stop && key.scheme == Scheme::GGM4;
+       lvl += 2) {
+    for (size_t j = 0; j < 4; j++)
+      (j < 2 ? cw.L : cw.R)[lvl + (j & 1)] = QuadCW(key, lvl, j);
+  }
+  cw.leaf = unpackLeafCW(key);
+  return cw;
+}
+
+// VAES/AVX-512 kernels: four 128-bit AES blocks per instruction. They are
+// compiled for that target only and chosen at runtime from CPUID, so the
+// same binary still runs on AES-NI/AVX2-only machines. Each kernel handles
+// a multiple of 16 seeds and returns how many it did; the AES-NI loops
+// finish the tail.
+#define VAES_TARGET __attribute__((target("avx512f,vaes")))
+// GCC 12 flags the self-initialised placeholders inside its own AVX-512
+// intrinsics as uninitialised.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+static bool cpuHasVAES() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("vaes");
+}
+
+static bool g_useVAES = cpuHasVAES();
+
+bool HasVAES() { return g_useVAES; }
+
+void SetVAES(bool enable) { g_useVAES = enable && cpuHasVAES(); }
+
+VAES_TARGET static inline __m512i getTMask512(__m512i in) {
+  return _mm512_srai_epi32(_mm512_shuffle_epi32(in, (_MM_PERM_ENUM)0xFF), 31);
+}
+
+// correction words of seeds i..i+3, where seed i belongs to key i >> log_n
+VAES_TARGET static inline __m512i loadCW4(const block *cw, size_t i,
+                                          size_t log_n) {
+  if ((i >> log_n) == ((i + 3) >> log_n))
+    return _mm512_broadcast_i32x4(cw[i >> log_n]);
+  __m512i v = _mm512_castsi128_si512(cw[i >> log_n]);
+  v = _mm512_inserti32x4(v, cw[(i + 1) >> log_n], 1);
+  v = _mm512_inserti32x4(v, cw[(i + 2) >> log_n], 2);
+  return _mm512_inserti32x4(v, cw[(i + 3) >> log_n], 3);
+}
+
+// leaf seeds behind leaf blocks i..i+3 (i a multiple of 4), block i being
+// converted from seed i >> log: four seeds, two seeds twice each, or one
+// seed four times
+VAES_TARGET static inline __m512i loadSeeds4(const block *in, size_t i,
+                                             size_t log) {
+  if (log == 0)
+    return _mm512_loadu_si512((const void *)(in + i));
+  if (log >= 2)
+    return _mm512_broadcast_i32x4(in[i >> log]);
+  const __m256i lo = _mm256_broadcastsi128_si256(in[i >> 1]);
+  const __m256i hi = _mm256_broadcastsi128_si256(in[(i >> 1) + 1]);
+  return _mm512_inserti64x4(_mm512_castsi256_si512(lo), hi, 1);
+}
+
+VAES_TARGET static size_t ExpandLevelVAES(const block *in, size_t total,
+                                          size_t log_n, const block *cwL,
+                                          const block *cwR, block *out) {
+  const __m512i msb = _mm512_broadcast_i32x4(MSBBlock);
+  __m512i kL[11], kR[11];
+  for (int r = 0; r < 11; r++) {
+    kL[r] = _mm512_broadcast_i32x4(mFixedKeyNI.rk[r]);
+    kR[r] = _mm512_broadcast_i32x4(mFixedKeyNI2.rk[r]);
+  }
+  // qword indices interleaving [l0 l1 l2 l3], [r0 r1 r2 r3] into
+  // [l0 r0 l1 r1] and [l2 r2 l3 r3]
+  const __m512i lo = _mm512_set_epi64(11, 10, 3, 2, 9, 8, 1, 0);
+  const __m512i hi = _mm512_set_epi64(15, 14, 7, 6, 13, 12, 5, 4);
+  size_t i = 0;
+  for (; i + 16 <= total; i += 16) {
+    __m512i raw[4], seed[4], L[4], R[4];
+    for (int j = 0; j < 4; j++) {
+      raw[j] = _mm512_loadu_si512((const void *)(in + i + 4 * j));
+      seed[j] = _mm512_andnot_si512(msb, raw[j]);
+      L[j] = _mm512_xor_si512(seed[j], kL[0]);
+      R[j] = _mm512_xor_si512(seed[j], kR[0]);
+    }
+    for (int r = 1; r < 10; r++) {
+      for (int j = 0; j < 4; j++) {
+        L[j] = _mm512_aesenc_epi128(L[j], kL[r]);
+        R[j] = _mm512_aesenc_epi128(R[j], kR[r]);
+      }
+    }
+    for (int j = 0; j < 4; j++) {
+      L[j] = _mm512_xor_si512(_mm512_aesenclast_epi128(L[j], kL[10]), seed[j]);
+      R[j] = _mm512_xor_si512(_mm512_aesenclast_epi128(R[j], kR[10]), seed[j]);
+      __m512i tt = getTMask512(raw[j]);
+      L[j] = _mm512_xor_si512(
+          L[j], _mm512_and_si512(loadCW4(cwL, i + 4 * j, log_n), tt));
+      R[j] = _mm512_xor_si512(
+          R[j], _mm512_and_si512(loadCW4(cwR, i + 4 * j, log_n), tt));
+      block *dst = out + 2 * (i + 4 * j);
+      _mm512_storeu_si512((void *)dst, _mm512_permutex2var_epi64(L[j], lo, R[j]));
+      _mm512_storeu_si512((void *)(dst + 4),
+                          _mm512_permutex2var_epi64(L[j], hi, R[j]));
+    }
+  }
+  return i;
+}
+
+// GGM4 level of one key: each seed is broadcast to a whole register, so one
+// AES pass yields its four children [c0 c1 c2 c3] already in output order.
+// cw holds the four child CWs. Handles a multiple of 8 seeds.
+VAES_TARGET static size_t ExpandLevelQuadVAES(const block *in, size_t n,
+                                              const block *cw, block *out) {
+  const __m512i msb = _mm512_broadcast_i32x4(MSBBlock);
+  const __m512i tweak = _mm512_set_epi64(3, 0, 2, 0, 1, 0, 0, 0);
+  const __m512i cw4 = _mm512_loadu_si512((const void *)cw);
+  __m512i k[11];
+  for (int r = 0; r < 11; r++)
+    k[r] = _mm512_broadcast_i32x4(mFixedKeyNI.rk[r]);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m512i tt[8], x[8], c[8];
+    for (int j = 0; j < 8; j++) {
+      __m512i raw = _mm512_broadcast_i32x4(in[i + j]);
+      tt[j] = getTMask512(raw);
+      x[j] = _mm512_xor_si512(_mm512_andnot_si512(msb, raw), tweak);
+      c[j] = _mm512_xor_si512(x[j], k[0]);
+    }
+    for (int r = 1; r < 10; r++)
+      for (int j = 0; j < 8; j++)
+        c[j] = _mm512_aesenc_epi128(c[j], k[r]);
+    for (int j = 0; j < 8; j++) {
+      c[j] = _mm512_xor_si512(_mm512_aesenclast_epi128(c[j], k[10]), x[j]);
+      c[j] = _mm512_xor_si512(c[j], _mm512_and_si512(cw4, tt[j]));
+      _mm512_storeu_si512((void *)(out + 4 * (i + j)), c[j]);
+    }
+  }
+  return i;
+}
+
+// n is the number of leaf blocks; block idx comes from seed idx >> leaf.log.
+VAES_TARGET static size_t ConvertLeavesVAES(const block *in, size_t n,
+                                            const LeafCW &leaf, uint8_t *out) {
+  const __m512i msb = _mm512_broadcast_i32x4(MSBBlock);
+  __m512i k[11];
+  for (int r = 0; r < 11; r++)
+    k[r] = _mm512_broadcast_i32x4(mFixedKeyNI.rk[r]);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512i raw[4], c[4];
+    for (int j = 0; j < 4; j++) {
+      const size_t idx = i + 4 * j;
+      raw[j] = loadSeeds4(in, idx, leaf.log);
+      c[j] = _mm512_andnot_si512(msb, raw[j]);
+      c[j] = _mm512_xor_si512(
+          c[j], _mm512_loadu_si512((const void *)(leaf.ctr + (idx & 7))));
+      c[j] = _mm512_xor_si512(c[j], k[0]);
+    }
+    for (int r = 1; r < 10; r++)
+      for (int j = 0; j < 4; j++)
+        c[j] = _mm512_aesenc_epi128(c[j], k[r]);
+    for (int j = 0; j < 4; j++) {
+      const size_t idx = i + 4 * j;
+      __m512i fin = _mm512_loadu_si512((const void *)(leaf.final + (idx & 7)));
+      c[j] = _mm512_aesenclast_epi128(c[j], k[10]);
+      c[j] = _mm512_xor_si512(c[j], _mm512_and_si512(fin, getTMask512(raw[j])));
+      _mm512_storeu_si512((void *)(out + 16 * idx), c[j]);
+    }
+  }
+  return i;
+}
+
+// (x & hi) ^ swap64(x), i.e. sigma on each 128-bit lane
+VAES_TARGET static inline __m512i Sigma512(__m512i x, __m512i hi) {
+  return _mm512_ternarylogic_epi64(
+      x, hi, _mm512_shuffle_epi32(x, (_MM_PERM_ENUM)0x4E), 0x6A);
+}
+
+// Both qwords of every lane whose seed has its LSB (control bit) set.
+VAES_TARGET static inline __mmask8 getLSBKMask512(__m512i in, __m512i one) {
+  return _mm512_test_epi64_mask(_mm512_shuffle_epi32(in, (_MM_PERM_ENUM)0x44),
+                                one);
+}
+
+// The MMO feed-forward and the t-masked CW are folded into the last round
+// key, aesenclast(s, k ^ y) = aesenclast(s, k) ^ y. Four vectors per
+// iteration keep state and round keys within the 32 zmm registers; wider
+// loops spill and lose most of the half-tree gain.
+VAES_TARGET static size_t ExpandLevelHalfTreeVAES(const block *in,
+                                                  size_t total, size_t log_n,
+                                                  const block *cw,
+                                                  block *out) {
+  const __m512i hi = _mm512_broadcast_i32x4(_mm_set_epi64x(-1, 0));
+  const __m512i one = _mm512_set1_epi64(1);
+  __m512i k[11];
+  for (int r = 0; r < 11; r++)
+    k[r] = _mm512_broadcast_i32x4(mFixedKeyNI.rk[r]);
+  const __m512i lo_idx = _mm512_set_epi64(11, 10, 3, 2, 9, 8, 1, 0);
+  const __m512i hi_idx = _mm512_set_epi64(15, 14, 7, 6, 13, 12, 5, 4);
+  size_t i = 0;
+  for (; i + 16 <= total; i += 16) {
+    __m512i seed[4], last[4], h[4];
+    for (int j = 0; j < 4; j++) {
+      seed[j] = _mm512_loadu_si512((const void *)(in + i + 4 * j));
+      __m512i x = Sigma512(seed[j], hi);
+      h[j] = _mm512_xor_si512(x, k[0]);
+      __m512i y = _mm512_mask_xor_epi64(x, getLSBKMask512(seed[j], one), x,
+                                        loadCW4(cw, i + 4 * j, log_n));
+      last[j] = _mm512_xor_si512(y, k[10]);
+    }
+    for (int r = 1; r < 10; r++)
+      for (int j = 0; j < 4; j++)
+        h[j] = _mm512_aesenc_epi128(h[j], k[r]);
+    for (int j = 0; j < 4; j++) {
+      __m512i L = _mm512_aesenclast_epi128(h[j], last[j]);
+      __m512i R = _mm512_xor_si512(L, seed[j]);
+      block *dst = out + 2 * (i + 4 * j);
+      _mm512_storeu_si512((void *)dst, _mm512_permutex2var_epi64(L, lo_idx, R));
+      _mm512_storeu_si512((void *)(dst + 4),
+                          _mm512_permutex2var_epi64(L, hi_idx, R));
+    }
+  }
+  return i;
+}
+
+VAES_TARGET static size_t ConvertLeavesHalfTreeVAES(const block *in, size_t n,
+                                                    const LeafCW &leaf,
+                                                    uint8_t *out) {
+  const __m512i hi = _mm512_broadcast_i32x4(_mm_set_epi64x(-1, 0));
+  const __m512i one = _mm512_set1_epi64(1);
+  __m512i k[11];
+  for (int r = 0; r < 11; r++)
+    k[r] = _mm512_broadcast_i32x4(mFixedKeyNI.rk[r]);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512i last[4], c[4];
+    for (int j = 0; j < 4; j++) {
+      const size_t idx = i + 4 * j;
+      __m512i raw = loadSeeds4(in, idx, leaf.log);
+      __m512i x = _mm512_xor_si512(
+          raw, _mm512_loadu_si512((const void *)(leaf.ctr + (idx & 7))));
+      x = Sigma512(x, hi);
+      c[j] = _mm512_xor_si512(x, k[0]);
+      __m512i fin = _mm512_loadu_si512((const void *)(leaf.final + (idx & 7)));
+      __m512i y = _mm512_mask_xor_epi64(x, getLSBKMask512(raw, one), x, fin);
+      last[j] = _mm512_xor_si512(y, k[10]);
+    }
+    for (int r = 1; r < 10; r++)
+      for (int j = 0; j < 4; j++)
+        c[j] = _mm512_aesenc_epi128(c[j], k[r]);
+    for (int j = 0; j < 4; j++)
+      _mm512_storeu_si512((void *)(out + 16 * (i + 4 * j)),
+                          _mm512_aesenclast_epi128(c[j], last[j]));
+  }
+  return i;
+}
+
+#pragma GCC diagnostic pop
+
+// Half-tree level: seed j (of key j >> log_n) yields L = H(s) ^ (t & cw)
+// and R = L ^ s, one hash for both children. As in the VAES kernel the
+// feed-forward and correction ride in the last round key.
+static void ExpandLevelHalfTree(const block *in, size_t total, size_t log_n,
+                                const block *cw, block *out) {
+  size_t i =
+      g_useVAES ? ExpandLevelHalfTreeVAES(in, total, log_n, cw, out) : 0;
+  const block *k = mFixedKeyNI.rk;
+  for (; i + 8 <= total; i += 8) {
+    block h[8], last[8];
+    for (size_t j = 0; j < 8; j++) {
+      block x = Sigma(in[i + j]);
+      h[j] = x ^ k[0];
+      last[j] = k[10] ^ x ^ (cw[(i + j) >> log_n] & getLSBMask(in[i + j]));
+    }
+    for (int r = 1; r < 10; r++)
+      for (size_t j = 0; j < 8; j++)
+        h[j] = _mm_aesenc_si128(h[j], k[r]);
+    for (size_t j = 0; j < 8; j++) {
+      block L = _mm_aesenclast_si128(h[j], last[j]);
+      out[2 * (i + j)] = L;
+      out[2 * (i + j) + 1] = L ^ in[i + j];
+    }
+  }
+  for (; i < total; i++) {
+    block L = HashCR(in[i]) ^ (cw[i >> log_n] & getLSBMask(in[i]));
+    out[2 * i] = L;
+    out[2 * i + 1] = L ^ in[i];
+  }
+}
+
+static void ConvertLeavesHalfTree(const block *in, size_t n,
+                                  const LeafCW &leaf, uint8_t *out) {
+  const size_t nb = n << leaf.log;
+  size_t i = g_useVAES ? ConvertLeavesHalfTreeVAES(in, nb, leaf, out) : 0;
+  const block *k = mFixedKeyNI.rk;
+  for (; i + 8 <= nb; i += 8) {
+    block c[8], last[8];
+    for (size_t j = 0; j < 8; j++) {
+      const block raw = in[(i + j) >> leaf.log];
+      block x = Sigma(raw ^ leaf.ctr[(i + j) & 7]);
+      c[j] = x ^ k[0];
+      last[j] = k[10] ^ x ^ (leaf.final[(i + j) & 7] & getLSBMask(raw));
+    }
+    for (int r = 1; r < 10; r++)
+      for (size_t j = 0; j < 8; j++)
+        c[j] = _mm_aesenc_si128(c[j], k[r]);
+    for (size_t j = 0; j < 8; j++)
+      _mm_storeu_si128((block *)(out + 16 * (i + j)),
+                       _mm_aesenclast_si128(c[j], last[j]));
+  }
+  for (; i < nb; i++) {
+    const block raw = in[i >> leaf.log];
+    block b = HashCR(raw ^ leaf.ctr[i & 7]) ^
+              (leaf.final[i & 7] & getLSBMask(raw));
+    _mm_storeu_si128((block *)(out + 16 * i), b);
+  }
+}
+
+// Children of in[0..n) go to out[2i] (left) and out[2i+1] (right), which
+// keeps the frontier in leaf order.
+static void ExpandLevel(const block *in, size_t n, block cwL, block cwR,
+                        block *out) {
+  size_t i = g_useVAES ? ExpandLevelVAES(in, n, 63, &cwL, &cwR, out) : 0;
+  for (; i + 8 <= n; i += 8) {
+    block seed[8], L[8], R[8];
+    for (size_t j = 0; j < 8; j++)
+      seed[j] = clr(in[i + j]);
+    prg::getLR<8>(seed, L, R);
+    for (size_t j = 0; j < 8; j++) {
+      block tt = getTMask(in[i + j]);
+      out[2 * (i + j)] = L[j] ^ (cwL & tt);
+      out[2 * (i + j) + 1] = R[j] ^ (cwR & tt);
+    }
+  }
+  for (; i < n; i++) {
+    block seed = clr(in[i]);
+    block L, R;
+    prg::getLR<1>(&seed, &L, &R);
+    block tt = getTMask(in[i]);
+    out[2 * i] = L ^ (cwL & tt);
+    out[2 * i + 1] = R ^ (cwR & tt);
+  }
+}
+
+// GGM4: the four children of in[i] go to out[4i..4i+3], corrected with
+// cw[0..3] where in[i]'s control bit is set.
+static void ExpandLevelQuad(const block *in, size_t n, const block *cw,
+                            block *out) {
+  size_t i = g_useVAES ? ExpandLevelQuadVAES(in, n, cw, out) : 0;
+  for (; i + 4 <= n; i += 4) {
+    block c[16];
+    for (size_t j = 0; j < 16; j++)
+      c[j] = clr(in[i + j / 4]) ^ QuadTweak(j & 3);
+    mFixedKeyNI.encryptECB_MMO16(c, c);
+    for (size_t j = 0; j < 16; j++)
+      out[4 * i + j] = c[j] ^ (cw[j & 3] & getTMask(in[i + j / 4]));
+  }
+  for (; i < n; i++) {
+    block c[4];
+    for (size_t j = 0; j < 4; j++)
+      c[j] = clr(in[i]) ^ QuadTweak(j);
+    mFixedKeyNI.encryptECB_MMO4(c, c);
+    for (size_t j = 0; j < 4; j++)
+      out[4 * i + j] = c[j] ^ (cw[j] & getTMask(in[i]));
+  }
+}
+
+// Leaf seeds in[0..n) become n << leaf.log blocks of output.
+static void ConvertLeaves(const block *in, size_t n, const LeafCW &leaf,
+                          uint8_t *out) {
+  if (leaf.scheme == Scheme::HalfTree) {
+    ConvertLeavesHalfTree(in, n, leaf, out);
+    return;
+  }
+  const size_t nb = n << leaf.log;
+  size_t i = g_useVAES ? ConvertLeavesVAES(in, nb, leaf, out) : 0;
+  for (; i + 8 <= nb; i += 8) {
+    block seed[8], conv[8];
+    for (size_t j = 0; j < 8; j++)
+      seed[j] = clr(in[(i + j) >> leaf.log]) ^ leaf.ctr[(i + j) & 7];
+    mFixedKeyNI.encryptECB8(seed, conv);
+    for (size_t j = 0; j < 8; j++) {
+      block b = conv[j] ^ (leaf.final[(i + j) & 7] &
+                           getTMask(in[(i + j) >> leaf.log]));
+      _mm_storeu_si128((block *)(out + 16 * (i + j)), b);
+    }
+  }
+  for (; i < nb; i++) {
+    const block raw = in[i >> leaf.log];
+    block b = ConvertBlock(clr(raw) ^ leaf.ctr[i & 7]) ^
+              (leaf.final[i & 7] & getTMask(raw));
+    _mm_storeu_si128((block *)(out + 16 * i), b);
+  }
+}
+
+// Tree levels one ExpandLevel call descends: 2 for GGM4, else 1.
+static inline size_t LevelStep(Scheme scheme) {
+  return scheme == Scheme::GGM4 ? 2 : 1;
+}
+
+// Level lvl of the key's tree, whatever its scheme: n seeds become
+// n << LevelStep(scheme) children, in leaf order.
+static void ExpandLevel(const LevelCW &cw, size_t lvl, const block *in,
+                        size_t n, block *out) {
+  if (cw.leaf.scheme == Scheme::HalfTree) {
+    ExpandLevelHalfTree(in, n, 63, &cw.L[lvl], out);
+  } else if (cw.leaf.scheme == Scheme::GGM4) {
+    const block quad[4] = {cw.L[lvl], cw.L[lvl + 1], cw.R[lvl],
+                           cw.R[lvl + 1]};
+    ExpandLevelQuad(in, n, quad, out);
+  } else {
+    ExpandLevel(in, n, cw.L[lvl], cw.R[lvl], out);
+  }
+}
+
+// Seeds per ping-pong buffer: 2 x 32 KiB stays in L2 while a subtree is
+// expanded one level at a time.
+static const size_t kBFSChunkLog = 11;
+
+// Expand the subtree rooted at s (level lvl) down to stop, one PRG pass per
+// level over the whole frontier, and write its 2^(stop - lvl) leaves to
+// out. Subtrees taller than a buffer are split depth-first first.
+static void EvalSubtreeBFS(const LevelCW &cw, block s, size_t lvl,
+                           size_t stop, block *bufA, block *bufB,
+                           uint8_t *out) {
+  const size_t step = LevelStep(cw.leaf.scheme);
+  if (stop - lvl > kBFSChunkLog) {
+    block children[4];
+    ExpandLevel(cw, lvl, &s, 1, children);
+    for (size_t c = 0; c < (1ULL << step); c++)
+      EvalSubtreeBFS(cw, children[c], lvl + step, stop, bufA, bufB,
+                     out + c * (16ULL << (stop - lvl - step + cw.leaf.log)));
+    return;
+  }
+  block *cur = bufA, *next = bufB;
+  cur[0] = s;
+  size_t n = 1;
+  for (; lvl < stop; lvl += step) {
+    ExpandLevel(cw, lvl, cur, n, next);
+    std::swap(cur, next);
+    n <<= step;
+  }
+  ConvertLeaves(cur, n, cw.leaf, out);
+}
+
+// Leaves [lo, hi) of the node s at level lvl are intersected with the
+// requested byte range [b0, b1) of the full output. Nodes wholly inside the
+// leaf-aligned part of the range are expanded breadth-first straight into
+// out; the (at most two) leaves straddling its ends go via a bounce buffer;
+// everything else is pruned without hashing.
+static void EvalRangeRecursive(const LevelCW &cw, block s, size_t lvl,
+                               size_t stop, size_t lo, size_t b0, size_t b1,
+                               block *bufA, block *bufB, uint8_t *out) {
+  const size_t lb = 16ULL << cw.leaf.log; // bytes per leaf
+  const size_t hi = lo + (1ULL << (stop - lvl));
+  if (lb * hi <= b0 || lb * lo >= b1)
+    return;
+  if (lb * lo >= b0 && lb * hi <= b1) {
+    EvalSubtreeBFS(cw, s, lvl, stop, bufA, bufB, out + lb * lo - b0);
+    return;
+  }
+  if (lvl == stop) {
+    uint8_t leaf[16ULL << kMaxLeafLog];
+    ConvertLeaves(&s, 1, cw.leaf, leaf);
+    size_t from = std::max(lb * lo, b0), to = std::min(lb * hi, b1);
+    memcpy(out + from - b0, leaf + from - lb * lo, to - from);
+    return;
+  }
+  const size_t step = LevelStep(cw.leaf.scheme);
+  block children[4];
+  ExpandLevel(cw, lvl, &s, 1, children);
+  for (size_t c = 0; c < (1ULL << step); c++)
+    EvalRangeRecursive(cw, children[c], lvl + step, stop,
+                       lo + (c << (stop - lvl - step)), b0, b1, bufA, bufB,
+                       out);
+}
+
+std::vector<uint8_t> EvalFullBFS(const Key &key,
+                                 size_t logn) {
+  std::vector<uint8_t> data(EvalFullSize(key, logn));
+  EvalFullInto(key, logn, data);
+  return data;
+}
+
+// The ping-pong buffers live on the stack, so this performs no heap
+// allocation at all. A truncated domain is the range [0, domain) of the
+// full tree: subtrees past it are pruned.
+void EvalFullInto(const Key &key, size_t logn,
+                  span<uint8_t> out) {
+  assert(logn <= 63);
+  const size_t bytes = EvalFullSize(key, logn);
+  assert((size_t)out.size() >= bytes);
+  size_t stop = TreeStop(logn, key.leaf_log);
+  assert(key.depth == stop);
+  LevelCW cw = unpackLevelCW(key, stop);
+
+  block s = PackedRoot(key);
+
+  block bufA[1ULL << kBFSChunkLog], bufB[1ULL << kBFSChunkLog];
+  EvalRangeRecursive(cw, s, 0, stop, 0, 0, bytes, bufA, bufB, out.data());
+  out[bytes - 1] &= TailMask(key);
+}
+
+std::vector<uint8_t> EvalFullParallel(const Key &key,
+                                      size_t logn, size_t threads) {
+  std::vector<uint8_t> data(EvalFullSize(key, logn));
+  EvalFullParallelInto(key, logn, data, threads);
   return data;
 }
+
+void EvalFullParallelInto(const Key &key, size_t logn,
+                          span<uint8_t> out, size_t threads) {
+  assert(logn <= 63);
+  const size_t bytes = EvalFullSize(key, logn);
+  assert((size_t)out.size() >= bytes);
+  size_t stop = TreeStop(logn, key.leaf_log);
+  assert(key.depth == stop);
+  LevelCW cw = unpackLevelCW(key, stop);
+
+  if (threads == 0)
+    threads = omp_get_max_threads();
+  // about four subtrees per thread, handed out dynamically, so a thread
+  // that drew subtrees past a truncated domain (or was descheduled) picks
+  // up more: expand the top ceil(log2(4T)) levels serially (rounded up to
+  // whole GGM4 levels)
+  const size_t step = LevelStep(key.scheme);
+  size_t top = 0;
+  while ((1ULL << top) < 4 * threads && top < stop)
+    top += step;
+
+  std::vector<block> frontier(1ULL << top), next(1ULL << top);
+  frontier[0] = PackedRoot(key);
+  for (size_t lvl = 0; lvl < top; lvl += step) {
+    ExpandLevel(cw, lvl, frontier.data(), 1ULL << lvl, next.data());
+    std::swap(frontier, next);
+  }
+
+  const size_t subtrees = 1ULL << top;
+#pragma omp parallel num_threads(threads)
+  {
+    block bufA[1ULL << kBFSChunkLog], bufB[1ULL << kBFSChunkLog];
+#pragma omp for schedule(dynamic)
+    for (size_t i = 0; i < subtrees; i++) {
+      EvalRangeRecursive(cw, frontier[i], top, stop, i << (stop - top), 0,
+                         bytes, bufA, bufB, out.data());
+    }
+  }
+  out[bytes - 1] &= TailMask(key);
+}
+
+// EvalSubtreeBFS with the tree shape fixed at compile time: the level, and
+// with it every correction-word index, frontier size and output offset, is
+// a template parameter, so the depth-first split and the level loop unroll
+// into straight-line calls.
+template <size_t Lvl, size_t Stop, bool Split = (Stop - Lvl > kBFSChunkLog)>
+struct SubtreeT;
+
+// Frontier of 2^K seeds at level Lvl + K, expanded down to Lvl + H.
+template <size_t Lvl, size_t K, size_t H> struct LevelsT {
+  static block *Expand(const LevelCW &cw, block *cur, block *next) {
+    ExpandLevel(cw, Lvl + K, cur, 1ULL << K, next);
+    return LevelsT<Lvl, K + 1, H>::Expand(cw, next, cur);
+  }
+};
+
+template <size_t Lvl, size_t H> struct LevelsT<Lvl, H, H> {
+  static block *Expand(const LevelCW &, block *cur, block *) { return cur; }
+};
+
+template <size_t Lvl, size_t Stop> struct SubtreeT<Lvl, Stop, true> {
+  static void Eval(const LevelCW &cw, block s, block *bufA, block *bufB,
+                   uint8_t *out) {
+    block children[2];
+    ExpandLevel(cw, Lvl, &s, 1, children);
+    SubtreeT<Lvl + 1, Stop>::Eval(cw, children[0], bufA, bufB, out);
+    SubtreeT<Lvl + 1, Stop>::Eval(
+        cw, children[1], bufA, bufB,
+        out + ((16ULL << (Stop - Lvl - 1)) << cw.leaf.log));
+  }
+};
+
+template <size_t Lvl, size_t Stop> struct SubtreeT<Lvl, Stop, false> {
+  static void Eval(const LevelCW &cw, block s, block *bufA, block *bufB,
+                   uint8_t *out) {
+    bufA[0] = s;
+    block *leaves = LevelsT<Lvl, 0, Stop - Lvl>::Expand(cw, bufA, bufB);
+    ConvertLeaves(leaves, 1ULL << (Stop - Lvl), cw.leaf, out);
+  }
+};
+
+template <size_t Stop> static void EvalTreeT(const Key &key, uint8_t *out) {
+  assert(key.depth == Stop);
+  LevelCW cw = unpackLevelCW(key, Stop);
+  block bufA[1ULL << kBFSChunkLog], bufB[1ULL << kBFSChunkLog];
+  SubtreeT<0, Stop>::Eval(cw, PackedRoot(key), bufA, bufB, out);
+}
+
+// The leaf packing sets the tree depth, so each LogN has one tree shape
+// per leaf_log.
+template <size_t LogN> void EvalFullT(const Key &key, span<uint8_t> out) {
+  static_assert(LogN >= 7 + kMaxLeafLog && LogN <= 63,
+                "EvalFullT needs a tree for every leaf packing");
+  // a key for another logn has another tree; the buffer is the caller's
+  if (key.depth != TreeStop(LogN, key.leaf_log) ||
+      (size_t)out.size() < EvalFullSize(key, LogN))
+    throw std::invalid_argument("EvalFullT: wrong logn or short buffer");
+  // the unrolled shapes are binary trees over the whole domain
+  if (key.domain || key.scheme == Scheme::GGM4) {
+    EvalFullInto(key, LogN, out);
+    return;
+  }
+  switch (key.leaf_log) {
+  case 0:
+    EvalTreeT<LogN - 7>(key, out.data());
+    break;
+  case 1:
+    EvalTreeT<LogN - 8>(key, out.data());
+    break;
+  case 2:
+    EvalTreeT<LogN - 9>(key, out.data());
+    break;
+  default:
+    EvalTreeT<LogN - 10>(key, out.data());
+    break;
+  }
+}
+
+template void EvalFullT<20>(const Key &key, span<uint8_t> out);
+template void EvalFullT<24>(const Key &key, span<uint8_t> out);
+template void EvalFullT<28>(const Key &key, span<uint8_t> out);
+template void EvalFullT<30>(const Key &key, span<uint8_t> out);
+
+void EvalFullTInto(const Key &key, size_t logn, span<uint8_t> out) {
+  switch (logn) {
+  case 20:
+    EvalFullT<20>(key, out);
+    break;
+  case 24:
+    EvalFullT<24>(key, out);
+    break;
+  case 28:
+    EvalFullT<28>(key, out);
+    break;
+  case 30:
+    EvalFullT<30>(key, out);
+    break;
+  default:
+    EvalFullInto(key, logn, out);
+    break;
+  }
+}
+
+std::vector<uint8_t> EvalRange(const Key &key, size_t logn,
+                               size_t begin, size_t end) {
+  std::vector<uint8_t> data((end - begin) / 8);
+  EvalRangeInto(key, logn, begin, end, data);
+  return data;
+}
+
+void EvalRangeInto(const Key &key, size_t logn, size_t begin,
+                   size_t end, span<uint8_t> out) {
+  assert(logn <= 63);
+  assert(begin % 8 == 0 && end % 8 == 0 && begin <= end);
+  assert(end / 8 <= EvalFullSize(key, logn));
+  assert((size_t)out.size() >= (end - begin) / 8);
+  if (begin == end)
+    return;
+  size_t stop = TreeStop(logn, key.leaf_log);
+  assert(key.depth == stop);
+  LevelCW cw = unpackLevelCW(key, stop);
+
+  block s = PackedRoot(key);
+
+  block bufA[1ULL << kBFSChunkLog], bufB[1ULL << kBFSChunkLog];
+  EvalRangeRecursive(cw, s, 0, stop, 0, begin / 8, end / 8, bufA, bufB,
+                     out.data());
+  if (end / 8 == EvalFullSize(key, logn))
+    out[(end - begin) / 8 - 1] &= TailMask(key);
+}
+
+// Tiles starting at or past byte `bytes` (the end of a truncated domain)
+// are never expanded; the one straddling it is cut short.
+static void EvalTilesRecursive(
+    const Key &key, const LevelCW &cw, block s, size_t lvl, size_t stop,
+    size_t tile_lvl, size_t lo, size_t bytes, block *bufA, block *bufB,
+    uint8_t *tile,
+    const std::function<void(size_t, const uint8_t *, size_t)> &fn) {
+  const size_t offset = (16ULL << cw.leaf.log) * lo;
+  if (offset >= bytes)
+    return;
+  if (lvl == tile_lvl) {
+    EvalSubtreeBFS(cw, s, lvl, stop, bufA, bufB, tile);
+    size_t len = std::min((size_t)16 << (stop - lvl + cw.leaf.log), bytes - offset);
+    if (offset + len == bytes)
+      tile[len - 1] &= TailMask(key);
+    fn(offset, tile, len);
+    return;
+  }
+  const size_t step = LevelStep(cw.leaf.scheme);
+  block children[4];
+  ExpandLevel(cw, lvl, &s, 1, children);
+  for (size_t c = 0; c < (1ULL << step); c++)
+    EvalTilesRecursive(key, cw, children[c], lvl + step, stop, tile_lvl,
+                       lo + (c << (stop - lvl - step)), bytes, bufA, bufB,
+                       tile, fn);
+}
+
+// Subtree height of one tile of at most tile_bytes, capped at one
+// ping-pong buffer and raised to one leaf; a whole number of GGM4 levels.
+static size_t TileLog(size_t tile_bytes, size_t leaf_log, size_t stop,
+                      Scheme scheme) {
+  assert(tile_bytes >= 16 && (tile_bytes & (tile_bytes - 1)) == 0);
+  size_t tile_log = 0;
+  while ((16ULL << (tile_log + 1 + leaf_log)) <= tile_bytes &&
+         tile_log + leaf_log < kBFSChunkLog && tile_log < stop)
+    tile_log++;
+  return tile_log - tile_log % LevelStep(scheme);
+}
+
+void EvalFullTiles(
+    const Key &key, size_t logn, size_t tile_bytes,
+    const std::function<void(size_t, const uint8_t *, size_t)> &fn) {
+  assert(logn <= 63);
+  size_t stop = TreeStop(logn, key.leaf_log);
+  assert(key.depth == stop);
+  LevelCW cw = unpackLevelCW(key, stop);
+
+  block s = PackedRoot(key);
+
+  size_t tile_log = TileLog(tile_bytes, cw.leaf.log, stop, key.scheme);
+
+  block bufA[1ULL << kBFSChunkLog], bufB[1ULL << kBFSChunkLog];
+  block tile[1ULL << kBFSChunkLog];
+  EvalTilesRecursive(key, cw, s, 0, stop, stop - tile_log, 0,
+                     EvalFullSize(key, logn), bufA, bufB, (uint8_t *)tile, fn);
+}
+
+// Nodes still to visit sit on an explicit stack, later children below
+// earlier ones, so tiles come out in order. Each pop either expands a node one level or,
+// at the tile level, expands the whole tile breadth-first into `tile`.
+struct ExpanderState {
+  struct Node {
+    block s;
+    size_t lvl, lo;
+  };
+  LevelCW cw;
+  size_t stop, tile_lvl, bytes, produced = 0;
+  uint8_t tail_mask;
+  Node stack[3 * Key::kMaxDepth + 1];
+  size_t depth = 0;
+  std::vector<block> bufA, bufB, tile;
+  size_t tile_pos = 0, tile_len = 0;
+};
+
+Expander::Expander(const Key &key, size_t logn, size_t tile_bytes)
+    : state_(new ExpanderState) {
+  assert(logn <= 63);
+  ExpanderState &st = *state_;
+  st.stop = TreeStop(logn, key.leaf_log);
+  assert(key.depth == st.stop);
+  st.cw = unpackLevelCW(key, st.stop);
+  st.tile_lvl =
+      st.stop - TileLog(tile_bytes, key.leaf_log, st.stop, key.scheme);
+  st.bytes = EvalFullSize(key, logn);
+  st.tail_mask = TailMask(key);
+  st.bufA.resize(1ULL << kBFSChunkLog);
+  st.bufB.resize(1ULL << kBFSChunkLog);
+  st.tile.resize(1ULL << kBFSChunkLog);
+  st.stack[st.depth++] = {PackedRoot(key), 0, 0};
+}
+
+Expander::~Expander() = default;
+
+size_t Expander::Offset() const { return state_->produced; }
+
+size_t Expander::Size() const { return state_->bytes; }
+
+bool Expander::NextTile() {
+  ExpanderState &st = *state_;
+  const size_t lb = 16ULL << st.cw.leaf.log;
+  while (st.depth > 0) {
+    const ExpanderState::Node n = st.stack[--st.depth];
+    const size_t offset = lb * n.lo;
+    if (offset >= st.bytes)
+      continue; // past a truncated domain
+    if (n.lvl == st.tile_lvl) {
+      uint8_t *tile = (uint8_t *)st.tile.data();
+      EvalSubtreeBFS(st.cw, n.s, n.lvl, st.stop, st.bufA.data(),
+                     st.bufB.data(), tile);
+      st.tile_len = std::min(lb << (st.stop - n.lvl), st.bytes - offset);
+      if (offset + st.tile_len == st.bytes)
+        tile[st.tile_len - 1] &= st.tail_mask;
+      st.tile_pos = 0;
+      return true;
+    }
+    const size_t step = LevelStep(st.cw.leaf.scheme);
+    block children[4];
+    ExpandLevel(st.cw, n.lvl, &n.s, 1, children);
+    for (size_t c = 1ULL << step; c-- > 0;)
+      st.stack[st.depth++] = {children[c], n.lvl + step,
+                              n.lo + (c << (st.stop - n.lvl - step))};
+  }
+  return false;
+}
+
+size_t Expander::NextChunk(span<uint8_t> out) {
+  ExpanderState &st = *state_;
+  size_t n = 0;
+  while (n < (size_t)out.size()) {
+    if (st.tile_pos == st.tile_len && !NextTile())
+      break;
+    size_t len = std::min((size_t)out.size() - n, st.tile_len - st.tile_pos);
+    memcpy(out.data() + n, (uint8_t *)st.tile.data() + st.tile_pos, len);
+    n += len;
+    st.tile_pos += len;
+    st.produced += len;
+  }
+  return n;
+}
+
+// Keys expanded together by EvalFullBatch. Their frontiers share one pair
+// of ping-pong buffers, so each key gets 1/kBatchKeys of a buffer.
+static const size_t kBatchKeys = 8;
+static const size_t kBatchKeysLog = 3;
+
+// ExpandLevel over the concatenated frontiers of several keys: seed j
+// belongs to key j >> log_n and is corrected with cwL[key] / cwR[key], so
+// a single pass hashes all keys' seeds 8 at a time.
+static void ExpandLevelBatch(Scheme scheme, const block *in, size_t total,
+                             size_t log_n, const block *cwL, const block *cwR,
+                             block *out) {
+  if (scheme == Scheme::HalfTree) {
+    ExpandLevelHalfTree(in, total, log_n, cwL, out);
+    return;
+  }
+  size_t i =
+      g_useVAES ? ExpandLevelVAES(in, total, log_n, cwL, cwR, out) : 0;
+  for (; i + 8 <= total; i += 8) {
+    block seed[8], L[8], R[8];
+    for (size_t j = 0; j < 8; j++)
+      seed[j] = clr(in[i + j]);
+    prg::getLR<8>(seed, L, R);
+    for (size_t j = 0; j < 8; j++) {
+      size_t k = (i + j) >> log_n;
+      block tt = getTMask(in[i + j]);
+      out[2 * (i + j)] = L[j] ^ (cwL[k] & tt);
+      out[2 * (i + j) + 1] = R[j] ^ (cwR[k] & tt);
+    }
+  }
+  for (; i < total; i++) {
+    size_t k = i >> log_n;
+    block seed = clr(in[i]);
+    block L, R;
+    prg::getLR<1>(&seed, &L, &R);
+    block tt = getTMask(in[i]);
+    out[2 * i] = L ^ (cwL[k] & tt);
+    out[2 * i + 1] = R ^ (cwR[k] & tt);
+  }
+}
+
+// Correction words of K keys, level-major: L[lvl * K + k]. Output past
+// byte `bytes` (a truncated domain) is not produced.
+struct BatchCW {
+  size_t K, bytes;
+  std::vector<block> L, R;
+  std::vector<LeafCW> leaf;
+};
+
+static void EvalSubtreeBatch(const BatchCW &cw, const block *s, size_t lvl,
+                             size_t stop, size_t chunk_log, block *bufA,
+                             block *bufB, uint8_t *const *out, size_t off) {
+  const size_t K = cw.K;
+  if (off >= cw.bytes)
+    return;
+  if (stop - lvl > chunk_log) {
+    block children[2 * kBatchKeys], left[kBatchKeys], right[kBatchKeys];
+    ExpandLevelBatch(cw.leaf[0].scheme, s, K, 0, &cw.L[lvl * K], &cw.R[lvl * K], children);
+    for (size_t k = 0; k < K; k++) {
+      left[k] = children[2 * k];
+      right[k] = children[2 * k + 1];
+    }
+    EvalSubtreeBatch(cw, left, lvl + 1, stop, chunk_log, bufA, bufB, out, off);
+    EvalSubtreeBatch(cw, right, lvl + 1, stop, chunk_log, bufA, bufB, out,
+                     off + (16ULL << (stop - lvl - 1 + cw.leaf[0].log)));
+    return;
+  }
+  block *cur = bufA, *next = bufB;
+  for (size_t k = 0; k < K; k++)
+    cur[k] = s[k];
+  size_t log_n = 0;
+  for (; lvl < stop; lvl++, log_n++) {
+    ExpandLevelBatch(cw.leaf[0].scheme, cur, K << log_n, log_n, &cw.L[lvl * K],
+                     &cw.R[lvl * K], next);
+    std::swap(cur, next);
+  }
+  const size_t lb = 16ULL << cw.leaf[0].log;
+  const size_t leaves =
+      std::min((size_t)1 << log_n, (cw.bytes - off + lb - 1) / lb);
+  for (size_t k = 0; k < K; k++)
+    ConvertLeaves(cur + (k << log_n), leaves, cw.leaf[k], out[k] + off);
+}
+
+void EvalFullBatch(const std::vector<std::vector<uint8_t>> &keys, size_t logn,
+                   std::vector<std::vector<uint8_t>> &outputs) {
+  std::vector<Key> parsed(keys.begin(), keys.end());
+  EvalFullBatch(parsed, logn, outputs);
+}
+
+void EvalFullBatch(const std::vector<Key> &keys, size_t logn,
+                   std::vector<std::vector<uint8_t>> &outputs) {
+  assert(logn <= 63);
+  if (keys.empty())
+    return;
+  // all keys share one tree depth and kernel, so they must share the leaf
+  // packing and scheme
+  const size_t leaf_log = keys[0].leaf_log;
+  size_t stop = TreeStop(logn, leaf_log);
+  for (const auto &key : keys)
+    assert(key.leaf_log == leaf_log && key.scheme == keys[0].scheme &&
+           key.depth == stop && key.domain == keys[0].domain);
+  // the leaf straddling a truncated domain's end is written whole, then
+  // the outputs are cut back to the domain
+  const size_t bytes = EvalFullSize(keys[0], logn);
+  const size_t padded = keys[0].domain
+                            ? (bytes + (16ULL << leaf_log) - 1) &
+                                  ~((16ULL << leaf_log) - 1)
+                            : bytes;
+  outputs.resize(keys.size());
+  // the interleaved kernels are binary; GGM4 keys go one at a time
+  if (keys[0].scheme == Scheme::GGM4) {
+    for (size_t k = 0; k < keys.size(); k++) {
+      if (outputs[k].size() < bytes || keys[0].domain)
+        outputs[k].resize(bytes);
+      EvalFullInto(keys[k], logn, outputs[k]);
+    }
+    return;
+  }
+  for (auto &out : outputs)
+    if (out.size() < padded)
+      out.resize(padded);
+
+  BatchCW cw;
+  cw.bytes = bytes;
+  cw.L.resize(stop * kBatchKeys);
+  cw.R.resize(stop * kBatchKeys);
+  cw.leaf.resize(kBatchKeys);
+  block bufA[1ULL << kBFSChunkLog], bufB[1ULL << kBFSChunkLog];
+
+  for (size_t first = 0; first < keys.size(); first += kBatchKeys) {
+    cw.K = std::min(kBatchKeys, keys.size() - first);
+    block roots[kBatchKeys];
+    uint8_t *out[kBatchKeys];
+    for (size_t k = 0; k < cw.K; k++) {
+      const Key &key = keys[first + k];
+      LevelCW one = unpackLevelCW(key, stop);
+      for (size_t lvl = 0; lvl < stop; lvl++) {
+        cw.L[lvl * cw.K + k] = one.L[lvl];
+        cw.R[lvl * cw.K + k] = one.R[lvl];
+      }
+      cw.leaf[k] = one.leaf;
+      roots[k] = PackedRoot(key);
+      out[k] = outputs[first + k].data();
+    }
+    EvalSubtreeBatch(cw, roots, 0, stop, kBFSChunkLog - kBatchKeysLog, bufA,
+                     bufB, out, 0);
+  }
+  if (keys[0].domain) {
+    for (auto &out : outputs) {
+      out.resize(bytes);
+      out[bytes - 1] &= TailMask(keys[0]);
+    }
+  }
+}
 } // namespace DPF
@@ -3,11 +3,166 @@
 #include <cstdlib>
 #include <vector>
 #include <cstdint>
+#include <functional>
+#include <memory>
+#include "../util/Defines.h"
 #include "../util/profiler.h"
 
 namespace DPF {
-    std::pair<std::vector<uint8_t>, std::vector<uint8_t> > Gen(size_t alpha, size_t logn);
-    bool Eval(const std::vector<uint8_t>& key, size_t x, size_t logn);
-    std::vector<uint8_t> EvalFull(const std::vector<uint8_t>& key, size_t logn);
-    std::vector<uint8_t> EvalFull8(const std::vector<uint8_t>& key, size_t logn);
+    // GGM: two fixed-key hashes per tree node, one per child.
+    // HalfTree: one correlation-robust hash per node derives both children
+    // (left = H(s) ^ t * CW, right = left ^ s), halving the expansion cost.
+    // GGM4: 4-ary GGM tree; one 4-block hash per node yields all four
+    // children, so the tree has half the levels of a GGM tree.
+    enum class Scheme { GGM = 0, HalfTree = 1, GGM4 = 2 };
+
+    // A key parsed out of its wire format (the byte vectors Gen returns):
+    // the root seed and final CW as aligned blocks, the per-level correction
+    // seeds as one contiguous array and the tLCW/tRCW bits packed into two
+    // words, so evaluators do no per-call parsing. Constructing from the
+    // wire bytes reads them in place, without an intermediate copy, and
+    // Serialize writes them straight into a caller buffer. A malformed
+    // wire key throws std::invalid_argument. Parsing is explicit, so a loop
+    // over keys parses each once instead of once per evaluator call.
+    struct Key {
+        static const size_t kMaxDepth = 64;
+
+        block seed;              // root seed (half-tree: control bit in the LSB)
+        uint64_t tL = 0, tR = 0; // bit lvl: tLCW / tRCW of level lvl (GGM)
+        uint8_t t = 0;           // root control bit (GGM)
+        uint8_t leaf_log = 0;
+        uint8_t depth = 0;       // tree levels above the leaves
+        uint64_t domain = 0;     // points in a truncated domain, 0 = all 2^logn
+        Scheme scheme = Scheme::GGM;
+        block final[8];          // 2^leaf_log blocks used
+        block cw[kMaxDepth];     // correction seed of each level
+        block cw_hi[kMaxDepth];  // GGM4 only, see dpf.cpp
+
+        Key() = default;
+        explicit Key(span<const uint8_t> wire);
+        explicit Key(const std::vector<uint8_t>& wire) : Key(span<const uint8_t>(wire.data(), wire.size())) {}
+
+        size_t WireSize() const;
+        void Serialize(span<uint8_t> out) const;
+        std::vector<uint8_t> Serialize() const;
+    };
+
+    // leaf_log (0..3) packs 7 + leaf_log levels into each leaf: a leaf seed
+    // is converted into 2^leaf_log blocks, so the tree is leaf_log levels
+    // shallower and 2^leaf_log times narrower at the bottom. It is capped at
+    // logn - 7 and recorded in the key's format byte; all evaluators read it
+    // from there and produce the same bitmap for every packing. The scheme
+    // is recorded next to it, and every evaluator dispatches on it. A GGM4
+    // tree needs an even number of levels, so for it leaf_log may also be
+    // moved by one to make logn - 7 - leaf_log even.
+    //
+    // domain (0 = 2^logn) truncates the domain to its first `domain`
+    // points, for record counts that are not a power of two (pick the
+    // smallest logn with 2^logn >= domain). It is recorded in the key:
+    // the full-domain evaluators write EvalFullSize(key, logn) bytes, clear
+    // the bits past the domain and never expand subtrees beyond it.
+    //
+    // Seeds come from a per-thread generator keyed from std::random_device.
+    std::pair<std::vector<uint8_t>, std::vector<uint8_t> > Gen(size_t alpha, size_t logn, size_t leaf_log = 0,
+                                                              Scheme scheme = Scheme::GGM,
+                                                              size_t domain = 0);
+    // Gen for many points: keys are generated 8 at a time with their levels
+    // hashed together, groups spread over `threads` OpenMP threads (0 = all).
+    // As in Gen, every thread draws from its own generator; under
+    // SetTestSeed(true) group g starts from the test seed XOR g instead,
+    // so the keys are the same for any thread count.
+    std::vector<std::pair<std::vector<uint8_t>, std::vector<uint8_t> > > GenBatch(
+        const std::vector<size_t>& alphas, size_t logn, size_t leaf_log = 0,
+        Scheme scheme = Scheme::GGM, size_t domain = 0, size_t threads = 0);
+
+    // For tests only: SetTestSeed(true) makes every Gen call start from
+    // PRNG's fixed test seed, and GenBatch seed its groups from it, so
+    // their keys are reproducible byte for byte.
+    void SetTestSeed(bool enable);
+    size_t KeyLeafLog(const Key& key);
+    Scheme KeyScheme(const Key& key);
+    bool Eval(const Key& key, size_t x, size_t logn);
+    // Eval at every point of xs, one 0/1 byte per point. Consecutive points
+    // share the tree walk down to their common prefix, so sorting xs keeps
+    // the cost near one PRG call per distinct node; leaves are converted 8
+    // per AES call. Any order gives the same result.
+    std::vector<uint8_t> EvalPoints(const Key& key, const std::vector<size_t>& xs, size_t logn);
+    std::vector<uint8_t> EvalFull(const Key& key, size_t logn);
+    std::vector<uint8_t> EvalFull8(const Key& key, size_t logn);
+    // Level-by-level expansion with one PRG pass per frontier; same output as EvalFull8.
+    std::vector<uint8_t> EvalFullBFS(const Key& key, size_t logn);
+    // EvalFullBFS split into disjoint subtrees over `threads` OpenMP threads (0 = all).
+    std::vector<uint8_t> EvalFullParallel(const Key& key, size_t logn, size_t threads = 0);
+
+    // Bytes written by the full-domain evaluators for a domain of 2^logn,
+    // and for the key's own (possibly truncated) domain.
+    size_t EvalFullSize(size_t logn);
+    size_t EvalFullSize(const Key& key, size_t logn);
+    // Allocation-free variants: write into a caller-owned buffer of at least
+    // EvalFullSize(key, logn) bytes. EvalFullInto is the breadth-first evaluator.
+    void EvalFull8Into(const Key& key, size_t logn, span<uint8_t> out);
+    void EvalFullInto(const Key& key, size_t logn, span<uint8_t> out);
+    void EvalFullParallelInto(const Key& key, size_t logn, span<uint8_t> out, size_t threads = 0);
+
+    // EvalFullInto with logn fixed at compile time, instantiated for the
+    // deployed sizes 20, 24, 28 and 30 only. Truncated-domain and GGM4 keys
+    // go to EvalFullInto; a key for another logn, or a buffer shorter than
+    // EvalFullSize(key, LogN), throws std::invalid_argument. EvalFullTInto
+    // picks the instantiation for logn at run time and falls back to
+    // EvalFullInto for other sizes.
+    template <size_t LogN> void EvalFullT(const Key& key, span<uint8_t> out);
+    void EvalFullTInto(const Key& key, size_t logn, span<uint8_t> out);
+
+    // Bitmap of the points [begin, end) only, i.e. bytes [begin/8, end/8) of
+    // the EvalFull output. begin and end must be multiples of 8. Subtrees
+    // outside the range are never expanded.
+    std::vector<uint8_t> EvalRange(const Key& key, size_t logn, size_t begin, size_t end);
+    void EvalRangeInto(const Key& key, size_t logn, size_t begin, size_t end, span<uint8_t> out);
+
+    // Full-domain evaluation of many keys, 8 at a time with their levels
+    // interleaved so every PRG pass covers all 8 frontiers. outputs[i] is
+    // grown to EvalFullSize(logn) if needed; with a truncated domain (the
+    // same for all keys) it is set to EvalFullSize(key, logn).
+    void EvalFullBatch(const std::vector<Key>& keys, size_t logn,
+                       std::vector<std::vector<uint8_t>>& outputs);
+    void EvalFullBatch(const std::vector<std::vector<uint8_t>>& keys, size_t logn,
+                       std::vector<std::vector<uint8_t>>& outputs);
+
+    // The breadth-first evaluators (BFS, Parallel, Range, Batch, Tiles) use
+    // VAES/AVX-512 kernels when CPUID reports them, AES-NI otherwise.
+    // SetVAES(false) forces the AES-NI path, e.g. for comparisons.
+    bool HasVAES();
+    void SetVAES(bool enable);
+
+    // Streams the EvalFull output through a tile of at most tile_bytes
+    // (power of two, capped at 32 KiB, raised to one leaf): fn(offset,
+    // tile, len) is called for each tile in order, with offset in bytes of
+    // the full output.
+    void EvalFullTiles(const Key& key, size_t logn, size_t tile_bytes,
+                       const std::function<void(size_t, const uint8_t*, size_t)>& fn);
+
+    struct ExpanderState;
+
+    // Pull-style EvalFull: the caller asks for the output a chunk at a time,
+    // of any size. Internally it walks the tree depth-first with an explicit
+    // stack of at most logn seeds and expands one tile (tile_bytes, as in
+    // EvalFullTiles) at a time, so at most one tile of the output exists
+    // at any point. Chunks come out in order and concatenate to the
+    // EvalFull output.
+    class Expander {
+    public:
+        Expander(const Key& key, size_t logn, size_t tile_bytes = 4096);
+        ~Expander();
+
+        // Fills out with the next bytes of the output; returns how many were
+        // written, less than out.size() only at the end (0 once done).
+        size_t NextChunk(span<uint8_t> out);
+        size_t Offset() const; // bytes produced so far
+        size_t Size() const;   // EvalFullSize(key, logn)
+        bool Done() const { return Offset() == Size(); }
+
+    private:
+        bool NextTile();
+        std::unique_ptr<ExpanderState> state_;
+    };
 }
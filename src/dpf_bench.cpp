@@ -0,0 +1,454 @@
+#include "./dpf/dpf.h"
+#include "./prf/AES.h"
+#include "./prf/AESNI.h"
+#include "util/profiler.h"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <omp.h>
+#include <string>
+#include <vector>
+#include <x86intrin.h>
+
+using namespace std;
+
+Profiler profiler;
+
+std::map<std::string, std::string> parse_args(int argc, char **argv) {
+  std::map<std::string, std::string> args;
+  for (int i = 1; i < argc; ++i) {
+    std::string token(argv[i]);
+    auto pos = token.find('=');
+    if (pos != std::string::npos)
+      args[token.substr(0, pos)] = token.substr(pos + 1);
+  }
+  return args;
+}
+
+// Cost per block of the fixed-key MMO hash at the batch widths the DPF
+// evaluators use, OpenSSL EVP against the inline AES-NI engine.
+void run_aes(size_t reps) {
+  const size_t total_blocks = 1 << 24;
+  std::vector<block> in(16), out(16);
+  for (size_t i = 0; i < 16; i++)
+    in[i] = _mm_set_epi64x(i, ~i);
+
+  for (size_t width : {1, 4, 8, 16}) {
+    const size_t calls = total_blocks / width;
+    string evp_event = "AES.EVP x" + to_string(width);
+    string ni_event = "AES.NI x" + to_string(width);
+    for (size_t r = 0; r < reps; r++) {
+      profiler.start(evp_event);
+      for (size_t c = 0; c < calls; c++) {
+        mFixedKey.encryptECB_MMO_Blocks(in.data(), width, out.data());
+        in[0] = out[0];
+      }
+      profiler.accumulate(evp_event);
+
+      profiler.start(ni_event);
+      for (size_t c = 0; c < calls; c++) {
+        mFixedKeyNI.encryptECB_MMO_Blocks(in.data(), width, out.data());
+        in[0] = out[0];
+      }
+      profiler.accumulate(ni_event);
+    }
+    double evp = profiler.getMedianTime(evp_event) * 1e6 / total_blocks;
+    double ni = profiler.getMedianTime(ni_event) * 1e6 / total_blocks;
+    printf("width %2zu : EVP %.2f ns/block, AES-NI %.2f ns/block, speedup "
+           "%.2fx\n",
+           width, evp, ni, evp / ni);
+  }
+  profiler.reset();
+}
+
+struct Evaluator {
+  string name;
+  std::vector<uint8_t> (*fn)(const DPF::Key &, size_t);
+};
+
+void run_evalfull(size_t logn_min, size_t logn_max, size_t reps) {
+  const std::vector<Evaluator> evaluators = {
+      {"EvalFull8", DPF::EvalFull8},
+      {"EvalFullBFS", DPF::EvalFullBFS},
+      {"EvalFullParallel",
+       [](const DPF::Key &key, size_t logn) {
+         return DPF::EvalFullParallel(key, logn);
+       }},
+  };
+  for (size_t logn = logn_min; logn <= logn_max; logn++) {
+    DPF::Key key(DPF::Gen(5, logn).first);
+    // two MMO calls per internal node and one conversion per leaf
+    double blocks = 3.0 * (1ULL << (logn - 7)) - 2;
+    for (const auto &ev : evaluators) {
+      string event_name = ev.name + " logN=" + to_string(logn);
+      std::vector<uint64_t> cycles;
+      for (size_t r = 0; r < reps; r++) {
+        profiler.start(event_name);
+        uint64_t c0 = __rdtsc();
+        auto query = ev.fn(key, logn);
+        cycles.push_back(__rdtsc() - c0);
+        profiler.accumulate(event_name);
+      }
+      std::sort(cycles.begin(), cycles.end());
+      double ms = profiler.getMedianTime(event_name);
+      printf("%s : %f ms, %.2f ns/AES block, %.3f AES blocks/cycle\n",
+             event_name.c_str(), ms, ms * 1e6 / blocks,
+             blocks / cycles[cycles.size() / 2]);
+    }
+  }
+  profiler.reset();
+}
+
+// EvalFullBFS time against the leaf packing width: 2^leaf_log blocks per
+// leaf seed, 7 + leaf_log levels folded into the final CW.
+void run_leafpack(size_t logn, size_t reps) {
+  for (size_t leaf_log = 0; leaf_log <= 3; leaf_log++) {
+    auto keys = DPF::Gen(5, logn, leaf_log);
+    DPF::Key key(keys.first);
+    std::vector<uint8_t> out(DPF::EvalFullSize(logn));
+    // two MMO calls per internal node, 2^leaf_log conversions per leaf
+    size_t leaves = 1ULL << (logn - 7 - leaf_log);
+    double blocks = 2.0 * (leaves - 1) + (double)(leaves << leaf_log);
+    string event_name = "EvalFullBFS leaf=" + to_string(1 << leaf_log);
+    for (size_t r = 0; r < reps; r++) {
+      profiler.start(event_name);
+      DPF::EvalFullInto(key, logn, out);
+      profiler.accumulate(event_name);
+    }
+    printf("logN=%zu %s : %f ms, %.0f AES blocks, key %zu bytes\n", logn,
+           event_name.c_str(), profiler.getMedianTime(event_name), blocks,
+           keys.first.size());
+  }
+  profiler.reset();
+}
+
+// GGM against half-tree keys, EvalFullBFS, with and without leaf packing.
+void run_halftree(size_t logn, size_t reps) {
+  for (size_t leaf_log : {0, 3}) {
+    size_t leaves = 1ULL << (logn - 7 - leaf_log);
+    double ms[2];
+    for (auto scheme : {DPF::Scheme::GGM, DPF::Scheme::HalfTree}) {
+      bool half = scheme == DPF::Scheme::HalfTree;
+      auto keys = DPF::Gen(5, logn, leaf_log, scheme);
+      DPF::Key key(keys.first);
+      std::vector<uint8_t> out(DPF::EvalFullSize(logn));
+      // hashes per internal node: two for GGM, one for half-tree
+      double blocks = (half ? 1.0 : 2.0) * (leaves - 1) +
+                      (double)(leaves << leaf_log);
+      string event_name = string(half ? "HalfTree" : "GGM") +
+                          " leaf=" + to_string(1 << leaf_log);
+      for (size_t r = 0; r < reps; r++) {
+        profiler.start(event_name);
+        DPF::EvalFullInto(key, logn, out);
+        profiler.accumulate(event_name);
+      }
+      ms[half] = profiler.getMedianTime(event_name);
+      printf("logN=%zu %s : %f ms, %.0f AES blocks, key %zu bytes\n", logn,
+             event_name.c_str(), ms[half], blocks, keys.first.size());
+    }
+    printf("logN=%zu leaf=%d : half-tree speedup %.2fx\n", logn,
+           1 << leaf_log, ms[0] / ms[1]);
+  }
+  profiler.reset();
+}
+
+// Binary GGM against 4-ary GGM4 keys at the same leaf packing (chosen so
+// the GGM4 tree needs no adjustment): EvalFullBFS, single-point Eval and
+// key size.
+void run_arity(size_t logn, size_t reps) {
+  const size_t points = 10000;
+  for (size_t leaf_log = (logn - 7) % 2; leaf_log <= 3; leaf_log += 2) {
+    double full[2], point[2];
+    for (auto scheme : {DPF::Scheme::GGM, DPF::Scheme::GGM4}) {
+      bool quad = scheme == DPF::Scheme::GGM4;
+      auto keys = DPF::Gen(5, logn, leaf_log, scheme);
+      DPF::Key key(keys.first);
+      std::vector<uint8_t> out(DPF::EvalFullSize(logn));
+      string name = string(quad ? "GGM4" : "GGM") +
+                    " leaf=" + to_string(1 << leaf_log);
+      size_t ones = 0;
+      for (size_t r = 0; r < reps; r++) {
+        profiler.start(name + " EvalFull");
+        DPF::EvalFullInto(key, logn, out);
+        profiler.accumulate(name + " EvalFull");
+        profiler.start(name + " Eval");
+        for (size_t i = 0; i < points; i++)
+          ones += DPF::Eval(key, (i * 2654435761ULL) % (1ULL << logn), logn);
+        profiler.accumulate(name + " Eval");
+      }
+      full[quad] = profiler.getMedianTime(name + " EvalFull");
+      point[quad] = profiler.getMedianTime(name + " Eval") * 1e3 / points;
+      printf("logN=%zu %s : EvalFull %f ms, Eval %.3f us, %zu levels, key "
+             "%zu bytes (%zu)\n",
+             logn, name.c_str(), full[quad], point[quad], (size_t)key.depth,
+             keys.first.size(), ones);
+    }
+    printf("logN=%zu leaf=%d : 4-ary speedup EvalFull %.2fx, Eval %.2fx\n",
+           logn, 1 << leaf_log, full[0] / full[1], point[0] / point[1]);
+  }
+  profiler.reset();
+}
+
+// Spot-check cost: Eval per point against EvalPoints on the same sorted
+// points, for sparse and clustered samples.
+void run_points(size_t logn, size_t m, size_t reps) {
+  DPF::Key key(DPF::Gen(5, logn).first);
+  for (size_t range : {(size_t)1 << logn, m * 16}) {
+    range = std::min(range, (size_t)1 << logn);
+    std::vector<size_t> xs(m);
+    for (size_t i = 0; i < m; i++)
+      xs[i] = (i * 2654435761ULL) % range;
+    std::sort(xs.begin(), xs.end());
+    string per_point = "Eval x" + to_string(m);
+    string batched = "EvalPoints x" + to_string(m);
+    size_t ones = 0;
+    for (size_t r = 0; r < reps; r++) {
+      profiler.start(per_point);
+      for (size_t x : xs)
+        ones += DPF::Eval(key, x, logn);
+      profiler.accumulate(per_point);
+
+      profiler.start(batched);
+      auto bits = DPF::EvalPoints(key, xs, logn);
+      profiler.accumulate(batched);
+      ones += bits[0];
+    }
+    double a = profiler.getMedianTime(per_point);
+    double b = profiler.getMedianTime(batched);
+    printf("logN=%zu %zu points in 2^%.0f : Eval %.3f us/point, EvalPoints "
+           "%.3f us/point, speedup %.2fx (%zu)\n",
+           logn, m, std::log2((double)range), a * 1e3 / m, b * 1e3 / m, a / b,
+           ones);
+    profiler.reset();
+  }
+}
+
+// Generic EvalFullInto against the compile-time EvalFullT instantiations,
+// for the deployed sizes.
+void run_fixed(const std::vector<size_t> &logns, size_t reps) {
+  for (size_t logn : logns) {
+    DPF::Key key(DPF::Gen(5, logn).first);
+    std::vector<uint8_t> out(DPF::EvalFullSize(logn));
+    string generic = "EvalFullInto logN=" + to_string(logn);
+    string fixed = "EvalFullT logN=" + to_string(logn);
+    for (size_t r = 0; r < reps; r++) {
+      profiler.start(generic);
+      DPF::EvalFullInto(key, logn, out);
+      profiler.accumulate(generic);
+
+      profiler.start(fixed);
+      DPF::EvalFullTInto(key, logn, out);
+      profiler.accumulate(fixed);
+    }
+    double a = profiler.getMedianTime(generic);
+    double b = profiler.getMedianTime(fixed);
+    printf("logN=%zu : EvalFullInto %f ms, EvalFullT %f ms, speedup %.3fx\n",
+           logn, a, b, a / b);
+  }
+  profiler.reset();
+}
+
+// EvalFullInto into a full-size buffer against an Expander pulled through
+// one small chunk buffer.
+void run_expander(size_t logn, size_t chunk, size_t reps) {
+  DPF::Key key(DPF::Gen(5, logn).first);
+  std::vector<uint8_t> full(DPF::EvalFullSize(logn)), buf(chunk);
+  string whole = "EvalFullInto logN=" + to_string(logn);
+  string stream = "Expander chunk=" + to_string(chunk);
+  for (size_t r = 0; r < reps; r++) {
+    profiler.start(whole);
+    DPF::EvalFullInto(key, logn, full);
+    profiler.accumulate(whole);
+
+    profiler.start(stream);
+    DPF::Expander expander(key, logn);
+    while (expander.NextChunk(buf) == chunk)
+      ;
+    profiler.accumulate(stream);
+  }
+  double a = profiler.getMedianTime(whole);
+  double b = profiler.getMedianTime(stream);
+  printf("logN=%zu : EvalFullInto %f ms (%zu byte buffer), Expander %f ms "
+         "(%zu byte buffer)\n",
+         logn, a, full.size(), b, chunk);
+  profiler.reset();
+}
+
+// Key generation throughput: Gen per key against GenBatch on one thread
+// and on all of them.
+void run_gen(size_t logn, size_t count, size_t reps) {
+  std::vector<size_t> alphas(count);
+  for (size_t i = 0; i < count; i++)
+    alphas[i] = (i * 2654435761ULL) % (1ULL << logn);
+  const size_t all = omp_get_max_threads();
+  for (auto scheme : {DPF::Scheme::GGM, DPF::Scheme::HalfTree}) {
+    string name = scheme == DPF::Scheme::GGM ? "GGM" : "HalfTree";
+    string single = name + " Gen", batch1 = name + " GenBatch threads=1",
+           batchN = name + " GenBatch threads=" + to_string(all);
+    size_t bytes = 0;
+    for (size_t r = 0; r < reps; r++) {
+      profiler.start(single);
+      for (size_t a : alphas)
+        bytes += DPF::Gen(a, logn, 0, scheme).first.size();
+      profiler.accumulate(single);
+
+      profiler.start(batch1);
+      bytes += DPF::GenBatch(alphas, logn, 0, scheme, 0, 1).size();
+      profiler.accumulate(batch1);
+
+      if (all > 1) {
+        profiler.start(batchN);
+        bytes += DPF::GenBatch(alphas, logn, 0, scheme, 0, all).size();
+        profiler.accumulate(batchN);
+      }
+    }
+    std::vector<string> events = {single, batch1};
+    if (all > 1)
+      events.push_back(batchN);
+    for (const string &ev : events)
+      printf("logN=%zu %s : %.0f keys/sec\n", logn, ev.c_str(),
+             count * 1e3 / profiler.getMedianTime(ev));
+    (void)bytes;
+  }
+  profiler.reset();
+}
+
+// Per-key EvalFull8 against key-interleaved EvalFullBatch, single thread,
+// into preallocated outputs.
+void run_batch(size_t logn, const std::vector<size_t> &batch_sizes,
+               size_t reps) {
+  for (size_t batch : batch_sizes) {
+    std::vector<DPF::Key> keys;
+    std::vector<std::vector<uint8_t>> outputs(batch);
+    for (size_t i = 0; i < batch; i++) {
+      keys.emplace_back(DPF::Gen((i * 7919) % (1ULL << logn), logn).first);
+      outputs[i].resize(DPF::EvalFullSize(logn));
+    }
+    string per_key = "EvalFull8 x" + to_string(batch);
+    string batched = "EvalFullBatch x" + to_string(batch);
+    for (size_t r = 0; r < reps; r++) {
+      profiler.start(per_key);
+      for (size_t i = 0; i < batch; i++)
+        DPF::EvalFull8Into(keys[i], logn, outputs[i]);
+      profiler.accumulate(per_key);
+
+      profiler.start(batched);
+      DPF::EvalFullBatch(keys, logn, outputs);
+      profiler.accumulate(batched);
+    }
+    double a = profiler.getMedianTime(per_key);
+    double b = profiler.getMedianTime(batched);
+    printf("logN=%zu batch %3zu : EvalFull8 %.3f ms/key, EvalFullBatch %.3f "
+           "ms/key, speedup %.2fx\n",
+           logn, batch, a / batch, b / batch, a / b);
+  }
+  profiler.reset();
+}
+
+int main(int argc, char **argv) {
+  auto args = parse_args(argc, argv);
+
+  if (!args.count("mode")) {
+    cerr << "Usage:\n"
+         << "  ./dpf_bench mode=aes reps=5\n"
+         << "  ./dpf_bench mode=evalfull logN=20 logN_max=30 reps=5\n"
+         << "  ./dpf_bench mode=batch logN=20 [batch=64] reps=5\n"
+         << "  ./dpf_bench mode=leafpack logN=24 reps=5\n"
+         << "  ./dpf_bench mode=halftree logN=24 reps=5\n"
+         << "  ./dpf_bench mode=arity logN=24 reps=5\n"
+         << "  ./dpf_bench mode=points logN=30 points=100000 reps=5\n"
+         << "  ./dpf_bench mode=fixed [logN=24] reps=5\n"
+         << "  ./dpf_bench mode=expander logN=24 chunk=1000 reps=5\n"
+         << "  ./dpf_bench mode=gen logN=30 keys=10000 reps=5\n"
+         << "  (vaes=0 forces the AES-NI PRG)\n";
+    return 1;
+  }
+
+  string mode = args["mode"];
+  if (args.count("vaes"))
+    DPF::SetVAES(stoul(args["vaes"]) != 0);
+  cout << "PRG : " << (DPF::HasVAES() ? "VAES/AVX-512" : "AES-NI") << endl;
+  size_t reps = args.count("reps") ? stoul(args["reps"]) : 5;
+
+  if (mode == "aes") {
+    run_aes(reps);
+  } else if (mode == "evalfull") {
+    size_t logn_min = args.count("logN") ? stoul(args["logN"]) : 20;
+    size_t logn_max =
+        args.count("logN_max") ? stoul(args["logN_max"]) : logn_min;
+    if (logn_min < 10 || logn_max < logn_min) {
+      cerr << "EvalFull needs 10 <= logN <= logN_max.\n";
+      return 1;
+    }
+    run_evalfull(logn_min, logn_max, reps);
+  } else if (mode == "batch") {
+    size_t logn = args.count("logN") ? stoul(args["logN"]) : 20;
+    if (logn < 10) {
+      cerr << "EvalFull8 needs logN >= 10.\n";
+      return 1;
+    }
+    std::vector<size_t> batch_sizes = {16, 32, 64, 128, 256};
+    if (args.count("batch"))
+      batch_sizes = {stoul(args["batch"])};
+    run_batch(logn, batch_sizes, reps);
+  } else if (mode == "leafpack") {
+    size_t logn = args.count("logN") ? stoul(args["logN"]) : 24;
+    if (logn < 10) {
+      cerr << "Leaf packing needs logN >= 10.\n";
+      return 1;
+    }
+    run_leafpack(logn, reps);
+  } else if (mode == "halftree") {
+    size_t logn = args.count("logN") ? stoul(args["logN"]) : 24;
+    if (logn < 10) {
+      cerr << "Half-tree comparison needs logN >= 10.\n";
+      return 1;
+    }
+    run_halftree(logn, reps);
+  } else if (mode == "arity") {
+    size_t logn = args.count("logN") ? stoul(args["logN"]) : 24;
+    if (logn < 10 || logn > 40) {
+      cerr << "Arity comparison needs 10 <= logN <= 40.\n";
+      return 1;
+    }
+    run_arity(logn, reps);
+  } else if (mode == "fixed") {
+    std::vector<size_t> logns = {20, 24, 28, 30};
+    if (args.count("logN"))
+      logns = {stoul(args["logN"])};
+    run_fixed(logns, reps);
+  } else if (mode == "expander") {
+    size_t logn = args.count("logN") ? stoul(args["logN"]) : 24;
+    size_t chunk = args.count("chunk") ? stoul(args["chunk"]) : 1000;
+    if (logn > 40 || chunk == 0) {
+      cerr << "Expander needs logN <= 40 and chunk >= 1.\n";
+      return 1;
+    }
+    run_expander(logn, chunk, reps);
+  } else if (mode == "gen") {
+    size_t logn = args.count("logN") ? stoul(args["logN"]) : 30;
+    size_t count = args.count("keys") ? stoul(args["keys"]) : 10000;
+    if (logn > 63 || count == 0) {
+      cerr << "Key generation needs logN <= 63 and keys >= 1.\n";
+      return 1;
+    }
+    run_gen(logn, count, reps);
+  } else if (mode == "points") {
+    size_t logn = args.count("logN") ? stoul(args["logN"]) : 30;
+    size_t m = args.count("points") ? stoul(args["points"]) : 100000;
+    if (logn < 7 || m == 0) {
+      cerr << "Point evaluation needs logN >= 7 and points >= 1.\n";
+      return 1;
+    }
+    run_points(logn, m, reps);
+  } else {
+    cerr << "Unknown mode: " << mode << endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -9,6 +9,19 @@ typedef struct {
   uint32_t database_size_bytes;
   uint32_t input_indexing_size_bytes;
   uint32_t num_batches;
+  // Record width the host laid the database out in; must match the
+  // dpu_task_<bytes> variant that was loaded.
+  uint32_t record_bytes;
 } dpu_args_t;
 
+// Values of the kernel's `status` variable after a launch. A DPU that did
+// not report DPU_STATUS_OK wrote no answers.
+#define DPU_STATUS_OK 0
+#define DPU_STATUS_BAD_WIDTH 1
+
+// Batches one launch can answer for records of the given width: the
+// kernel's WRAM reduction buffer holds 1 KiB of records per tasklet.
+#define DPU_MAX_BATCH(record_bytes) \
+  (1024 / (record_bytes) > 0 ? 1024 / (record_bytes) : 1)
+
 #endif // __COMMON_H__
\ No newline at end of file
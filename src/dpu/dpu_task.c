@@ -8,37 +8,53 @@
 #include <seqread.h>
 #include <stdint.h>
 
+// Record width in 64-bit words; the build makes one dpu_task_<bytes>
+// variant per width with -DSIZE=<bytes / 8>.
 #ifndef SIZE
 #define SIZE 4                               
 #endif
 
-typedef struct { int64_t w[SIZE]; } uint256_t;
+typedef struct { int64_t w[SIZE]; } record_t;
+
+// Words per seqread step: a record wider than the 256-byte read cache is
+// streamed in chunks.
+#define CHUNK_WORDS (SIZE < 32 ? SIZE : 32)
+_Static_assert(SIZE % CHUNK_WORDS == 0, "record must be whole chunks");
 
 #ifndef BLOCK_LOG2
 #define BLOCK_LOG2 12                      
 #endif
-#define BLOCK       (1U << BLOCK_LOG2)
-#define GROUP_SIZE  (8 * sizeof(uint256_t))  // 1 index byte per 8 records
+#define GROUP_SIZE  (8 * sizeof(record_t))  // 1 index byte per 8 records
+// a block always holds whole groups, so its index bytes start on bit 0
+#define BLOCK       ((1U << BLOCK_LOG2) > GROUP_SIZE ? (1U << BLOCK_LOG2) : GROUP_SIZE)
+// Tasklet t takes blocks t, t + NR_TASKLETS, ...: each block exactly once,
+// each starting on a group boundary.
+_Static_assert(BLOCK % GROUP_SIZE == 0, "blocks must hold whole groups");
 
 #ifndef MAX_BATCH
-#define MAX_BATCH 32
+#define MAX_BATCH DPU_MAX_BATCH(SIZE * 8)
 #endif
 
 // Tile batches. 4 or 8 is a good trade-off.
 #ifndef B_TILE
-#define B_TILE 4
+#define B_TILE (MAX_BATCH < 4 ? MAX_BATCH : 4)
 #endif
 
-static inline void xor256(uint256_t *d, const uint256_t *s) {
+static inline void xor_record(record_t *d, const record_t *s) {
     for (int i = 0; i < SIZE; i++) d->w[i] ^= s->w[i];
 }
 
 BARRIER_INIT(my_barrier, NR_TASKLETS);
 
 __host dpu_args_t args;                      
-__host uint256_t out[MAX_BATCH];                    
+__host record_t out[MAX_BATCH];                    
+// DPU_STATUS_*, read back by the host after every launch; 64 bits wide so
+// the transfer is a whole number of 8-byte words
+__host uint64_t status;
 
-static uint256_t shared[MAX_BATCH][NR_TASKLETS];
+static record_t shared[MAX_BATCH][NR_TASKLETS];
+// the tile accumulators, in WRAM rather than on the tasklet stack
+static record_t tile_acc[NR_TASKLETS][B_TILE];
 
 int main(void)
 {
@@ -47,6 +63,13 @@ int main(void)
     mem_reset();
     barrier_wait(&my_barrier);
 
+    // the host loaded the variant for another record width
+    if (args.record_bytes != sizeof(record_t)) {
+        if (tid == 0) status = DPU_STATUS_BAD_WIDTH;
+        return -1;
+    }
+    if (tid == 0) status = DPU_STATUS_OK;
+
     const uint32_t  db_size     = args.database_size_bytes;
     uint32_t        num_batches = args.num_batches;
     if (num_batches == 0) num_batches = 1;
@@ -55,7 +78,7 @@ int main(void)
     const uintptr_t data_base   = (uintptr_t)DPU_MRAM_HEAP_POINTER;
     const uintptr_t index_base  = data_base + db_size;
 
-    const uint32_t rec_size      = sizeof(uint256_t);
+    const uint32_t rec_size      = sizeof(record_t);
     const uint32_t total_records = db_size / rec_size;           
     const uint32_t index_stride  = (total_records + 7) >> 3;    
 
@@ -70,7 +93,7 @@ int main(void)
         idx_cache[tb] = seqread_alloc();
 
     // Local accumulators for a tile of batches
-    uint256_t acc[B_TILE];
+    record_t *acc = tile_acc[tid];
 
     // Process batches in tiles to limit inner-loop footprint
     for (uint32_t base_b = 0; base_b < num_batches; base_b += B_TILE) {
@@ -79,10 +102,10 @@ int main(void)
 
         // zero the tile accumulators
         for (uint32_t tb = 0; tb < tile_cnt; ++tb)
-            acc[tb] = (uint256_t){{0}};
+            acc[tb] = (record_t){{0}};
 
         // Stripe the database across tasklets
-        for (uintptr_t off = ((uintptr_t)tid << BLOCK_LOG2);
+        for (uintptr_t off = (uintptr_t)tid * BLOCK;
              off < db_size;
              off += (uintptr_t)BLOCK * NR_TASKLETS)
         {
@@ -91,7 +114,7 @@ int main(void)
             if (!rec_cnt) break;
 
             // stream records
-            uint256_t *recp = (uint256_t *)seqread_init(
+            int64_t *recp = (int64_t *)seqread_init(
                 data_cache, (__mram_ptr void *)(data_base + off), &dr);
 
             // stream index bytes for this block for each batch in the tile
@@ -121,25 +144,20 @@ int main(void)
 
                 // up to 8 records under these bits
                 for (int k = 0; k < 8 && i < rec_cnt; ++k, ++i) {
-                    // load record words once
-                    int64_t w0 = recp->w[0];
-                    int64_t w1 = recp->w[1];
-                    int64_t w2 = recp->w[2];
-                    int64_t w3 = recp->w[3];
-
-                    // apply to each batch in the tile
-                    for (uint32_t tb = 0; tb < tile_cnt; ++tb) {
-                        const uint64_t umask = 0U - (uint64_t)((idx_byte[tb] >> k) & 1U);
-                        const int64_t  mask  = (int64_t)umask;
-                        acc[tb].w[0] ^= (w0 & mask);
-                        acc[tb].w[1] ^= (w1 & mask);
-                        acc[tb].w[2] ^= (w2 & mask);
-                        acc[tb].w[3] ^= (w3 & mask);
+                    // one chunk of the record at a time, applied to each
+                    // batch in the tile
+                    for (uint32_t c = 0; c < SIZE; c += CHUNK_WORDS) {
+                        for (uint32_t tb = 0; tb < tile_cnt; ++tb) {
+                            const uint64_t umask = 0U - (uint64_t)((idx_byte[tb] >> k) & 1U);
+                            const int64_t  mask  = (int64_t)umask;
+                            for (uint32_t w = 0; w < CHUNK_WORDS; ++w)
+                                acc[tb].w[c + w] ^= (recp[w] & mask);
+                        }
+
+                        // advance record stream
+                        recp = (int64_t *)seqread_get(
+                            recp, CHUNK_WORDS * sizeof(int64_t), &dr);
                     }
-
-                    // advance record stream
-                    if (i + 1 <= rec_cnt)
-                        recp = (uint256_t *)seqread_get(recp, sizeof(*recp), &dr);
                 }
             }
         }
@@ -151,10 +169,11 @@ int main(void)
         }
         barrier_wait(&my_barrier);
 
-        for (int step = NR_TASKLETS >> 1; step > 0; step >>= 1) {
-            if (tid < step) {
+        // pairwise tree; NR_TASKLETS need not be a power of two
+        for (uint32_t step = 1; step < NR_TASKLETS; step <<= 1) {
+            if (tid % (2 * step) == 0 && tid + step < NR_TASKLETS) {
                 for (uint32_t b = base_b; b < base_b + tile_cnt; ++b)
-                    xor256(&shared[b][tid], &shared[b][tid + step]);
+                    xor_record(&shared[b][tid], &shared[b][tid + step]);
             }
             barrier_wait(&my_barrier);
         }
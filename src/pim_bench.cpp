@@ -2,6 +2,7 @@
 #include "dpu/common.h"
 #include "datastore.h"
 #include "util/concurentqueue.h"
+#include "util/memstats.h"
 #include "util/profiler.h"
 #include "util/queue.h"
 #include <algorithm>
@@ -13,9 +14,11 @@
 #include <cstring>
 #include <dpu>
 #include <iostream>
+#include <iterator>
 #include <map>
 #include <omp.h>
 #include <random>
+#include <stdexcept>
 #include <vector>
 
 using namespace std;
@@ -23,7 +26,9 @@ using namespace dpu;
 
 #define SIZE_GB 1024 * 1024 * 1024
 
-#define BINARY_NAME "dpu_task"
+// the kernel variant built for datastore's record width
+static const std::string BINARY_NAME =
+    "dpu_task_" + std::to_string(sizeof(datastore::db_record));
 
 static std::vector<dpu::DpuSet *> dpu_clusters;
 
@@ -33,9 +38,10 @@ Profiler profiler;
 std::vector<dpu_args_t> args(1);
 
 void setup_database(datastore &store, size_t num_elements, size_t cluster);
-void execution_pim(size_t N, std::vector<uint8_t> aaaa);
-void pim_batch_execution(size_t N, datastore &store, size_t batch_size,
-                         size_t reps);
+void execution_pim(size_t N,
+                   const std::vector<std::vector<uint8_t>> &dpu_input_vectors);
+void pim_batch_execution(size_t N, size_t num_elements, datastore &store,
+                         size_t batch_size, size_t reps);
 
 std::map<std::string, std::string> parse_args(int argc, char **argv) {
   std::map<std::string, std::string> args;
@@ -48,38 +54,91 @@ std::map<std::string, std::string> parse_args(int argc, char **argv) {
   return args;
 }
 
-void run_single_query_pim(datastore &store, size_t N, size_t reps) {
+// Records held by each DPU when num_elements records are spread over `dpus`
+// DPUs. Rounded up to a multiple of 8 so every DPU's slice of the query
+// bitmap starts on a byte boundary, whatever the DPU count.
+static size_t records_per_dpu(size_t num_elements, size_t dpus) {
+  size_t per = (num_elements + dpus - 1) / dpus;
+  return (per + 7) / 8 * 8;
+}
+
+// Evaluate the DPF only over each DPU's shard of the num_elements records,
+// directly into that DPU's input buffer, sharded exactly as setup_database
+// shards the records. Buffers are records_per_dpu / 8 bytes; the tail
+// of a short last shard is left zero. Single-threaded, one Expander streams
+// the bitmap into the buffers in order instead of walking the tree from
+// the root for every shard.
+static void eval_dpu_slices(const DPF::Key &key, size_t N,
+                            size_t num_elements, size_t dpus,
+                            std::vector<std::vector<uint8_t>> &slices,
+                            size_t threads) {
+  const size_t per = records_per_dpu(num_elements, dpus);
+  if (threads == 0)
+    threads = omp_get_max_threads();
+  slices.resize(dpus);
+  if (threads == 1) {
+    DPF::Expander expander(key, N);
+    for (size_t i = 0; i < dpus; i++) {
+      slices[i].resize(per / 8);
+      size_t n = expander.NextChunk(slices[i]);
+      std::fill(slices[i].begin() + n, slices[i].end(), 0);
+    }
+    return;
+  }
+  const size_t bitmap_end = (num_elements + 7) / 8 * 8;
+#pragma omp parallel for num_threads(threads)
+  for (size_t i = 0; i < dpus; i++) {
+    // shards end on whole bitmap bytes; the last one takes the partial
+    // byte, whose bits past the domain EvalRangeInto clears
+    size_t start = std::min(i * per, bitmap_end);
+    size_t end = std::min(start + per, bitmap_end);
+    slices[i].resize(per / 8);
+    DPF::EvalRangeInto(key, N, start, end, slices[i]);
+    // a reused buffer may hold an older query past this shard's end
+    std::fill(slices[i].begin() + (end - start) / 8, slices[i].end(), 0);
+  }
+}
+
+void run_single_query_pim(datastore &store, size_t N, size_t num_elements,
+                          size_t reps, size_t threads) {
 
   // 1. setup the database
   // 2. generate keys
   // 3. evaluate keys
   // 4. perform the dot product or xor operation for the CPU variant.
   //
+  std::vector<std::vector<uint8_t>> dpu_input_vectors;
+  MemStats mem_before = MemStats::now();
   for (size_t r = 0; r < reps; r++) {
 
     profiler.start("DPF.KeyGen");
-    auto keys = DPF::Gen(5, N);
+    // keys over the records actually stored (the whole 2^N without db=)
+    auto keys = DPF::Gen(std::min<size_t>(5, num_elements - 1), N, 0,
+                         DPF::Scheme::GGM, num_elements);
     profiler.accumulate("DPF.KeyGen");
 
-    auto a = keys.first;
+    DPF::Key a(keys.first);
     // auto b = keys.second; // Not used in this example only for one server
-    std::vector<uint8_t> aaaa;
 
     profiler.start("DPF.Eval");
-    aaaa = DPF::EvalFull8(a, N);
+    eval_dpu_slices(a, N, num_elements, NUM_DPUS, dpu_input_vectors,
+                    threads);
     profiler.accumulate("DPF.Eval");
 
-    execution_pim(N, aaaa);
+    execution_pim(N, dpu_input_vectors);
   }
+  MemStats mem = MemStats::now() - mem_before;
 
   profiler.printAllTimes(true); // Print the median time
   profiler.reset();
+  std::cout << "Per query:" << std::endl;
+  mem.print(std::cout, reps);
   printf("\n");
 }
 
-void run_batch_query_pim(datastore &store, size_t N, size_t batch_size,
-                         size_t cluster, size_t reps) {
-  pim_batch_execution(N, store, batch_size, reps);
+void run_batch_query_pim(datastore &store, size_t N, size_t num_elements,
+                         size_t batch_size, size_t cluster, size_t reps) {
+  pim_batch_execution(N, num_elements, store, batch_size, reps);
 }
 
 int main(int argc, char **argv) {
@@ -88,9 +147,12 @@ int main(int argc, char **argv) {
 
   if (!args.count("mode") || !args.count("logN")) {
     cerr << "Usage:\n"
-         << "  ./pim_bench num_dpus=256 mode=single logN=20 reps=10\n"
+         << "  ./pim_bench num_dpus=256 mode=single logN=20 reps=10 "
+            "threads=32\n"
          << "  ./pim_bench num_dpus=256 mode=batch logN=20 batch=64 cluster=1 "
-            "reps=10\n";
+            "reps=10\n"
+         << "  (db=FILE shards a file saved by datastore::save to the DPUs\n"
+         << "   instead of synthetic records)\n";
     return 1;
   }
 
@@ -100,21 +162,34 @@ int main(int argc, char **argv) {
   size_t batch_size = args.count("batch") ? stoul(args["batch"]) : 1;
   size_t cluster = args.count("cluster") ? stoul(args["cluster"]) : 1;
   size_t num_dpus = args.count("num_dpus") ? stoul(args["num_dpus"]) : 128;
+  size_t threads = args.count("threads") ? stoul(args["threads"]) : 0;
   NUM_DPUS = num_dpus;
 
   size_t num_elements = 1ULL << N;
+  datastore store;
+  if (args.count("db")) {
+    try {
+      store = datastore::open_mmap(args["db"], datastore::kMapPopulate);
+    } catch (const std::runtime_error &e) {
+      cerr << e.what() << endl;
+      return 1;
+    }
+    num_elements = store.size();
+    if (num_elements == 0 || num_elements > (1ULL << N)) {
+      cerr << "db must hold between 1 and 2^logN records.\n";
+      return 1;
+    }
+  }
   double DB_size =
       static_cast<double>(num_elements * sizeof(datastore::db_record)) /
       static_cast<double>(SIZE_GB);
-  datastore store;
-  store.reserve(num_elements);
   cout << "Database Size: " << DB_size << " GB" << endl;
   setup_database(store, num_elements, cluster);
 
   if (mode == "single") {
-    run_single_query_pim(store, N, reps);
+    run_single_query_pim(store, N, num_elements, reps, threads);
   } else if (mode == "batch") {
-    run_batch_query_pim(store, N, batch_size, cluster, reps);
+    run_batch_query_pim(store, N, num_elements, batch_size, cluster, reps);
   } else {
     cerr << "Unknown mode: " << mode << endl;
     return 1;
@@ -142,25 +217,30 @@ void setup_database(datastore &store, size_t num_elements,
       printf("DPUs per cluster: %zu\n", DPUS_PER_CLUSTER);
     }
 
-    size_t data_per_dpu =
-        (num_elements + DPUS_PER_CLUSTER - 1) / DPUS_PER_CLUSTER;
+    size_t data_per_dpu = records_per_dpu(num_elements, DPUS_PER_CLUSTER);
     size_t database_size_per_dpu_bytes =
         data_per_dpu * sizeof(datastore::db_record);
     args[0].database_size_bytes = database_size_per_dpu_bytes;
     args[0].num_batches = 1;
+    args[0].record_bytes = sizeof(datastore::db_record);
 
     std::vector<std::vector<uint64_t>> dpu_store(DPUS_PER_CLUSTER);
+    const size_t words = sizeof(datastore::db_record) / sizeof(uint64_t);
 
 #pragma omp parallel for
     for (size_t i = 0; i < DPUS_PER_CLUSTER; i++) {
-      size_t start = i * data_per_dpu;
+      size_t start = std::min(i * data_per_dpu, num_elements);
       size_t end = std::min(start + data_per_dpu, num_elements);
-      for (size_t j = start; j < end; j++) {
-        dpu_store[i].push_back(j);
-        dpu_store[i].push_back(j);
-        dpu_store[i].push_back(j);
-        dpu_store[i].push_back(j);
+      // zero records pad the last shard; they never contribute to the XOR
+      dpu_store[i].assign(data_per_dpu * words, 0);
+      if (store.mapped()) {
+        // a database opened with db=: its records, straight from the map
+        std::memcpy(dpu_store[i].data(), store.data() + start,
+                    (end - start) * sizeof(datastore::db_record));
+        continue;
       }
+      for (size_t j = start; j < end; j++)
+        std::fill_n(dpu_store[i].begin() + (j - start) * words, words, j);
     }
 
     for (size_t i = 0; i < cluster; i++) {
@@ -173,24 +253,30 @@ void setup_database(datastore &store, size_t num_elements,
   }
 }
 
+// Exits if any of the set's `dpus` DPUs did not report DPU_STATUS_OK for
+// the launch just run: its "out" holds no answers.
+static void check_dpu_status(dpu::DpuSet &set, size_t dpus) {
+  std::vector<std::vector<uint64_t>> status(dpus, std::vector<uint64_t>(1));
+  set.copy(status, "status");
+  for (size_t i = 0; i < dpus; i++) {
+    if (status[i][0] == DPU_STATUS_OK)
+      continue;
+    std::cerr << "DPU " << i << " failed with status " << status[i][0]
+              << (status[i][0] == DPU_STATUS_BAD_WIDTH
+                      ? ": " + BINARY_NAME + " does not match record_bytes"
+                      : "")
+              << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
 // This execution is mainly for single query execution
-void execution_pim(size_t N, std::vector<uint8_t> aaaa) {
+void execution_pim(size_t N,
+                   const std::vector<std::vector<uint8_t>> &dpu_input_vectors) {
   std::vector<std::vector<uint8_t>> output_vectors(NUM_DPUS,
                                                    std::vector<uint8_t>(32, 0));
 
-  size_t elements_per_dpu = (aaaa.size() + NUM_DPUS - 1) / NUM_DPUS;
-  std::vector<std::vector<uint8_t>> dpu_input_vectors(NUM_DPUS);
-
-#pragma omp parallel for
-  for (size_t i = 0; i < NUM_DPUS; i++) {
-    auto start = aaaa.begin() + std::min(i * elements_per_dpu, aaaa.size());
-    auto end =
-        (i == NUM_DPUS - 1)
-            ? aaaa.end()
-            : aaaa.begin() + std::min((i + 1) * elements_per_dpu, aaaa.size());
-    dpu_input_vectors[i] = std::vector<uint8_t>(start, end);
-  }
-  args[0].input_indexing_size_bytes = elements_per_dpu;
+  args[0].input_indexing_size_bytes = dpu_input_vectors[0].size();
 
   profiler.start("PIR.PIM_Total");
   profiler.start("COPY.CPU->PIM");
@@ -203,6 +289,7 @@ void execution_pim(size_t N, std::vector<uint8_t> aaaa) {
   profiler.start("PIR.PIMexec");
   dpu_clusters[0]->exec();
   profiler.accumulate("PIR.PIMexec");
+  check_dpu_status(*dpu_clusters[0], NUM_DPUS / dpu_clusters.size());
 
   profiler.start("COPY.PIM->CPU");
   // dpu_set->copy(output_vectors, "out");
@@ -223,17 +310,17 @@ void execution_pim(size_t N, std::vector<uint8_t> aaaa) {
 }
 
 
-void pim_batch_execution(size_t N, datastore &store, size_t batch_size,
-                         size_t reps) {
+void pim_batch_execution(size_t N, size_t num_elements, datastore &store,
+                         size_t batch_size, size_t reps) {
   // ---------------------------------------------
   // 1. Key generation 
   // ---------------------------------------------
-  std::vector<std::vector<uint8_t>> keys(batch_size);
+  std::vector<DPF::Key> keys;
   std::mt19937 rng(std::random_device{}());
-  std::uniform_int_distribution<size_t> dist(0, N - 1);
+  std::uniform_int_distribution<size_t> dist(0, num_elements - 1);
   for (size_t i = 0; i < batch_size; ++i) {
-    auto kp = DPF::Gen(dist(rng), N);
-    keys[i] = kp.first;
+    auto kp = DPF::Gen(dist(rng), N, 0, DPF::Scheme::GGM, num_elements);
+    keys.emplace_back(kp.first);
   }
 
   const size_t num_dpus = NUM_DPUS / dpu_clusters.size();
@@ -241,30 +328,29 @@ void pim_batch_execution(size_t N, datastore &store, size_t batch_size,
   // using db_record = datastore::db_record;
 
   moodycamel::ConcurrentQueue<BatchData> queue;
+  // input buffers the submitters are done with, handed back to the workers
+  // so each query reuses num_dpus slices instead of allocating them
+  moodycamel::ConcurrentQueue<BatchData> spare;
   std::atomic<bool> producers_done{false};
 
   // ---------------------------------------------
   // 3. CPU producer threads (enqueue)
   // ---------------------------------------------
+  const size_t num_workers =
+      std::min<size_t>(16, std::max<size_t>(1, batch_size / 4));
+
   auto cpu_worker = [&](size_t start, size_t end) {
     moodycamel::ProducerToken ptoken(queue);
+    BatchData data;
     for (size_t b = start; b < end; ++b) {
-      BatchData data;
-
-      // Perform DPF evaluation
-      data.query = DPF::EvalFull8(keys[b], N); 
-
-      // Split the input query into num_dpus parts
-      size_t elems = (data.query.size() + num_dpus - 1) / num_dpus;
-      data.dpu_input_vectors.resize(num_dpus);
-      for (size_t j = 0; j < num_dpus; ++j) {
-        auto s = data.query.begin() + std::min(j * elems, data.query.size());
-        auto e = (j + 1 == num_dpus)
-                     ? data.query.end()
-                     : data.query.begin() +
-                           std::min((j + 1) * elems, data.query.size());
-        data.dpu_input_vectors[j] = std::vector<uint8_t>(s, e);
-      }
+      // a recycled buffer if there is one; otherwise the moved-from scratch
+      // is grown afresh
+      spare.try_dequeue(data);
+
+      // Evaluate each DPU's shard of the domain straight into its input;
+      // the full bitmap is never built
+      eval_dpu_slices(keys[b], N, num_elements, num_dpus,
+                      data.dpu_input_vectors, 1);
 
       // Enqueue the batch data
       queue.enqueue(ptoken, std::move(data));
@@ -278,8 +364,11 @@ void pim_batch_execution(size_t N, datastore &store, size_t batch_size,
       auto dpu_submitter = [&](dpu::DpuSet *set) {
         moodycamel::ConsumerToken ctoken(queue);
         // reserve a small buffer for bulk pop
-        std::vector<BatchData> buf(32);
+        std::vector<BatchData> buf(
+            DPU_MAX_BATCH(sizeof(datastore::db_record)));
         std::vector<dpu_args_t> arguments(1);
+        // one concatenated input per DPU, cleared and refilled each round
+        std::vector<std::vector<uint8_t>> batched_inputs(num_dpus);
 
         while (true) {
             size_t got = queue.try_dequeue_bulk(ctoken, buf.data(), buf.size());
@@ -315,7 +404,8 @@ void pim_batch_execution(size_t N, datastore &store, size_t batch_size,
             // }
             
             size_t output_size_per_dpu = sizeof(datastore::db_record)*got;
-            std::vector<std::vector<uint8_t>> batched_inputs(num_dpus);
+            for (auto &in : batched_inputs)
+                in.clear();
             std::vector<std::vector<uint8_t>> dpu_out(num_dpus, std::vector<uint8_t>(output_size_per_dpu)); 
 
             for (size_t idx = 0; idx < got; ++idx) {
@@ -326,13 +416,16 @@ void pim_batch_execution(size_t N, datastore &store, size_t batch_size,
                     }
                 }
             }
+            spare.enqueue_bulk(std::make_move_iterator(buf.begin()), got);
             arguments[0].input_indexing_size_bytes = batched_inputs[0].size()/got;
             arguments[0].num_batches = got;
             arguments[0].database_size_bytes = args[0].database_size_bytes;
+            arguments[0].record_bytes = args[0].record_bytes;
 
             set->copy("args", arguments);
             set->copy(DPU_MRAM_HEAP_POINTER_NAME, args[0].database_size_bytes, batched_inputs);
             set->exec();
+            check_dpu_status(*set, num_dpus);
             // set->copy(dpu_out, output_size_per_dpu, DPU_MRAM_HEAP_POINTER_NAME, args[0].database_size_bytes);
             set->copy(dpu_out, "out");
 
@@ -348,11 +441,10 @@ void pim_batch_execution(size_t N, datastore &store, size_t batch_size,
           }
     };
 
+  MemStats mem_before = MemStats::now();
   profiler.start(event_name);
   for (size_t r = 0; r < reps; ++r) {
     // ---- launch producers ----
-    const size_t num_workers =
-        std::min<size_t>(16, std::max<size_t>(1, batch_size / 4));
     std::vector<std::thread> producers;
     size_t per = batch_size / num_workers;
     size_t rem = batch_size % num_workers;
@@ -380,7 +472,11 @@ void pim_batch_execution(size_t N, datastore &store, size_t batch_size,
     producers_done.store(false, std::memory_order_relaxed);
   }
 
+  MemStats mem = MemStats::now() - mem_before;
+
   profiler.printAllTimes(true);
   double tp = (batch_size * 1000.0) / profiler.getAverageTime(event_name);
   std::cout << "Throughput: " << tp << " q/s" << std::endl;
+  std::cout << "Per query:" << std::endl;
+  mem.print(std::cout, batch_size * reps);
 }
\ No newline at end of file
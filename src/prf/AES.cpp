@@ -1,4 +1,5 @@
 #include "AES.h"
+#include "AESNI.h"
 #include <openssl/evp.h>
 #include <openssl/err.h>
 #include <cstring>
@@ -8,6 +9,8 @@ const uint8_t fixed_key[16] = {36,156,50,234,92,230,49,9,174,170,205,160,98,236,
 const uint8_t fixed_key2[16] = {209, 12, 199, 173, 29, 74, 44, 128, 194, 224, 14, 44, 2, 201, 110, 28};
 const AES mFixedKey(fixed_key);
 const AES mFixedKey2(fixed_key2);
+const AESNI mFixedKeyNI(fixed_key);
+const AESNI mFixedKeyNI2(fixed_key2);
 
 AES::AES() : encrypt_ctx(nullptr), decrypt_ctx(nullptr), initialized(false) {
     uint8_t zerokey[16] = {0};
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include "../util/Defines.h"
+#include <wmmintrin.h>
+
+// Fixed-key AES-128 on AES-NI. The round keys are expanded once and every
+// encrypt call is inline, so the DPF PRG compiles down to interleaved
+// aesenc sequences instead of an EVP_EncryptUpdate call per batch.
+// Produces the same ciphertexts as AES::encryptECB for the same key.
+class AESNI {
+public:
+    AESNI() = default;
+    explicit AESNI(const block& key) { setKey(key); }
+    explicit AESNI(const uint8_t* key) { setKey(toBlock(key)); }
+
+    void setKey(const block& key) {
+        rk[0] = key;
+        rk[1] = expandStep(rk[0], _mm_aeskeygenassist_si128(rk[0], 0x01));
+        rk[2] = expandStep(rk[1], _mm_aeskeygenassist_si128(rk[1], 0x02));
+        rk[3] = expandStep(rk[2], _mm_aeskeygenassist_si128(rk[2], 0x04));
+        rk[4] = expandStep(rk[3], _mm_aeskeygenassist_si128(rk[3], 0x08));
+        rk[5] = expandStep(rk[4], _mm_aeskeygenassist_si128(rk[4], 0x10));
+        rk[6] = expandStep(rk[5], _mm_aeskeygenassist_si128(rk[5], 0x20));
+        rk[7] = expandStep(rk[6], _mm_aeskeygenassist_si128(rk[6], 0x40));
+        rk[8] = expandStep(rk[7], _mm_aeskeygenassist_si128(rk[7], 0x80));
+        rk[9] = expandStep(rk[8], _mm_aeskeygenassist_si128(rk[8], 0x1B));
+        rk[10] = expandStep(rk[9], _mm_aeskeygenassist_si128(rk[9], 0x36));
+    }
+
+    block encryptECB(const block& plaintext) const {
+        block c = _mm_xor_si128(plaintext, rk[0]);
+        for (int r = 1; r < 10; r++)
+            c = _mm_aesenc_si128(c, rk[r]);
+        return _mm_aesenclast_si128(c, rk[10]);
+    }
+
+    block encryptECB_MMO(const block& plaintext) const {
+        return _mm_xor_si128(encryptECB(plaintext), plaintext);
+    }
+
+    // N independent blocks run round by round so the AES unit always has
+    // N encryptions in flight. in and out may alias.
+    template<size_t N>
+    void encryptECBN(const block* plaintexts, block* ciphertexts) const {
+        block c[N];
+        for (size_t i = 0; i < N; i++)
+            c[i] = _mm_xor_si128(plaintexts[i], rk[0]);
+        for (int r = 1; r < 10; r++)
+            for (size_t i = 0; i < N; i++)
+                c[i] = _mm_aesenc_si128(c[i], rk[r]);
+        for (size_t i = 0; i < N; i++)
+            ciphertexts[i] = _mm_aesenclast_si128(c[i], rk[10]);
+    }
+
+    template<size_t N>
+    void encryptECB_MMO_N(const block* plaintexts, block* ciphertexts) const {
+        block p[N];
+        for (size_t i = 0; i < N; i++)
+            p[i] = plaintexts[i];
+        encryptECBN<N>(p, ciphertexts);
+        for (size_t i = 0; i < N; i++)
+            ciphertexts[i] = _mm_xor_si128(ciphertexts[i], p[i]);
+    }
+
+    void encryptECB4(const block* in, block* out) const { encryptECBN<4>(in, out); }
+    void encryptECB8(const block* in, block* out) const { encryptECBN<8>(in, out); }
+    void encryptECB16(const block* in, block* out) const { encryptECBN<16>(in, out); }
+    void encryptECB_MMO4(const block* in, block* out) const { encryptECB_MMO_N<4>(in, out); }
+    void encryptECB_MMO8(const block* in, block* out) const { encryptECB_MMO_N<8>(in, out); }
+    void encryptECB_MMO16(const block* in, block* out) const { encryptECB_MMO_N<16>(in, out); }
+
+    // Arbitrary-length variants: 16-wide main loop, then 8/4/1 tails.
+    void encryptECBBlocks(const block* plaintexts, uint64_t blockLength, block* ciphertexts) const {
+        uint64_t i = 0;
+        for (; i + 16 <= blockLength; i += 16)
+            encryptECBN<16>(plaintexts + i, ciphertexts + i);
+        if (i + 8 <= blockLength) {
+            encryptECBN<8>(plaintexts + i, ciphertexts + i);
+            i += 8;
+        }
+        if (i + 4 <= blockLength) {
+            encryptECBN<4>(plaintexts + i, ciphertexts + i);
+            i += 4;
+        }
+        for (; i < blockLength; i++)
+            ciphertexts[i] = encryptECB(plaintexts[i]);
+    }
+
+    void encryptECB_MMO_Blocks(const block* plaintexts, uint64_t blockLength, block* ciphertexts) const {
+        uint64_t i = 0;
+        for (; i + 16 <= blockLength; i += 16)
+            encryptECB_MMO_N<16>(plaintexts + i, ciphertexts + i);
+        if (i + 8 <= blockLength) {
+            encryptECB_MMO_N<8>(plaintexts + i, ciphertexts + i);
+            i += 8;
+        }
+        if (i + 4 <= blockLength) {
+            encryptECB_MMO_N<4>(plaintexts + i, ciphertexts + i);
+            i += 4;
+        }
+        for (; i < blockLength; i++)
+            ciphertexts[i] = encryptECB_MMO(plaintexts[i]);
+    }
+
+    block rk[11];
+
+private:
+    static block expandStep(block key, block assist) {
+        assist = _mm_shuffle_epi32(assist, _MM_SHUFFLE(3, 3, 3, 3));
+        key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+        key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+        key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+        return _mm_xor_si128(key, assist);
+    }
+};
+
+// Same keys as mFixedKey / mFixedKey2, defined next to them in AES.cpp.
+extern const AESNI mFixedKeyNI;
+extern const AESNI mFixedKeyNI2;
@@ -1,40 +1,847 @@
 #include "./dpf/dpf.h"
+#include "./prf/AES.h"
+#include "./prf/AESNI.h"
 #include "datastore.h"
 #include "dpu/common.h"
+#include <algorithm>
 #include <cstddef>
 #include <chrono>
 #include <iostream>
 #include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <unistd.h>
 
+// Appends records 0..n to a store; record i holds i in its low word, so a
+// PIR answer reads back as the index it selected.
+template <typename Store> static void fill_store(Store &store, size_t n) {
+  store.reserve(store.size() + n);
+  for (size_t i = 0; i < n; i++)
+    store.push_back(_mm256_set_epi64x(i, 3 * i, ~i, i));
+}
 
 int testCPU() {
   size_t N = 20;
   datastore store;
-  store.reserve(1ULL << N);
-  for (size_t i = 0; i < (1ULL << N); i++) {
-    store.push_back(_mm256_set_epi64x(i, i, i, i));
-  }
+  fill_store(store, 1ULL << N);
 
   auto keys = DPF::Gen(123456, N);
   auto a = keys.first;
   auto b = keys.second;
-  std::vector<uint8_t> aaaa = DPF::EvalFull8(a, N);
-  std::vector<uint8_t> bbbb = DPF::EvalFull8(b, N);
+  std::vector<uint8_t> aaaa = DPF::EvalFull8(DPF::Key(a), N);
+  std::vector<uint8_t> bbbb = DPF::EvalFull8(DPF::Key(b), N);
   datastore::db_record answerA = store.answer_pir(aaaa);
   datastore::db_record answerB = store.answer_pir(bbbb);
   datastore::db_record answer = _mm256_xor_si256(answerA, answerB);
-  if (_mm256_extract_epi64(answer, 0) == 123456) {
-    return 0;
-  } else {
+  if (_mm256_extract_epi64(answer, 0) != 123456) {
     std::cout << "PIR answer wrong\n";
     return -1;
   }
+  datastore::db_record fused =
+      _mm256_xor_si256(store.answer_dpf(a, N), store.answer_dpf(b, N));
+  if (_mm256_extract_epi64(fused, 0) != 123456) {
+    std::cout << "Fused PIR answer wrong\n";
+    return -1;
+  }
+  auto packed = DPF::Gen(123456, N, 3);
+  fused = _mm256_xor_si256(store.answer_dpf(packed.first, N),
+                           store.answer_dpf(packed.second, N));
+  if (_mm256_extract_epi64(fused, 0) != 123456) {
+    std::cout << "Fused PIR answer wrong with packed leaves\n";
+    return -1;
+  }
+  auto half = DPF::Gen(123456, N, 0, DPF::Scheme::HalfTree);
+  fused = _mm256_xor_si256(store.answer_dpf(half.first, N),
+                           store.answer_dpf(half.second, N));
+  if (_mm256_extract_epi64(fused, 0) != 123456) {
+    std::cout << "Fused PIR answer wrong with half-tree keys\n";
+    return -1;
+  }
+  // the parallel scan must agree with the serial one for any thread count
+  // and for record counts that end mid-block and mid-group
+  for (size_t threads : {1, 3, 8}) {
+    for (size_t n : {(size_t)5, (size_t)1000, (size_t)123461, store.size()}) {
+      if (!_mm256_testz_si256(
+              _mm256_xor_si256(store.answer_pir_parallel(aaaa, n, threads),
+                               store.answer_pir(aaaa, n)),
+              _mm256_set1_epi64x(-1))) {
+        std::cout << "parallel PIR scan disagrees with " << threads
+                  << " threads, " << n << " records\n";
+        return -1;
+      }
+    }
+  }
+  // the AVX-512 and AVX2 scan kernels must agree, odd group counts included
+  for (size_t n : {(size_t)7, (size_t)8, (size_t)24, (size_t)1001, store.size()}) {
+    datastore::SetAVX512(false);
+    datastore::db_record avx2 = store.answer_pir(aaaa, n);
+    datastore::SetAVX512(true);
+    if (!_mm256_testz_si256(_mm256_xor_si256(store.answer_pir(aaaa, n), avx2),
+                            _mm256_set1_epi64x(-1))) {
+      std::cout << "AVX-512 scan disagrees with AVX2 for " << n
+                << " records\n";
+      return -1;
+    }
+  }
+  // a batch that is not a whole number of tiles, over a record count that
+  // ends mid-group, must give the answers of one answer_pir per bitmap
+  datastore odd;
+  fill_store(odd, 70001);
+  std::vector<std::vector<uint8_t>> bitmaps;
+  for (size_t j = 0; j < datastore::kBatchTile + 3; j++)
+    bitmaps.push_back(DPF::EvalFull(
+        DPF::Key(DPF::Gen(j * 6007, 17, 0, DPF::Scheme::GGM, 70001).first),
+        17));
+  for (size_t threads : {1, 3}) {
+    datastore::aligned_vector answers, table;
+    odd.answer_pir_batch_tiled(bitmaps, answers, threads);
+    odd.answer_pir_batch_table(bitmaps, table, threads);
+    for (size_t j = 0; j < bitmaps.size(); j++) {
+      if (answers.size() != bitmaps.size() || table.size() != answers.size() ||
+          !_mm256_testz_si256(_mm256_xor_si256(table[j], answers[j]),
+                              _mm256_set1_epi64x(-1)) ||
+          !_mm256_testz_si256(
+              _mm256_xor_si256(answers[j], odd.answer_pir(bitmaps[j])),
+              _mm256_set1_epi64x(-1))) {
+        std::cout << "batch PIR answer " << j << " wrong with " << threads
+                  << " threads\n";
+        return -1;
+      }
+    }
+  }
+  // answer_pir_batch picks its engine by batch size; either way it answers
+  // as the tiled scan does
+  std::vector<std::vector<uint8_t>> many;
+  for (size_t j = 0; j < datastore::kTableMinBatch; j++)
+    many.push_back(bitmaps[j % bitmaps.size()]);
+  for (const auto *batch : {&bitmaps, &many}) {
+    datastore::aligned_vector answers, tiled;
+    odd.answer_pir_batch(*batch, answers, 2);
+    odd.answer_pir_batch_tiled(*batch, tiled, 2);
+    if (answers.size() != tiled.size() ||
+        std::memcmp(answers.data(), tiled.data(),
+                    tiled.size() * sizeof(tiled[0])) != 0) {
+      std::cout << "answer_pir_batch wrong for a batch of " << batch->size()
+                << "\n";
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int testAESNI() {
+  block in[16], ref[16], out[16];
+  for (size_t i = 0; i < 16; i++) {
+    in[i] = _mm_set_epi64x(i * 0x9e3779b97f4a7c15ULL, ~i);
+  }
+  mFixedKey.encryptECB_MMO_Blocks(in, 16, ref);
+  mFixedKeyNI.encryptECB_MMO16(in, out);
+  for (size_t i = 0; i < 16; i++) {
+    if (neq(ref[i], out[i])) {
+      std::cout << "AES-NI MMO mismatch\n";
+      return -1;
+    }
+  }
+  for (size_t n = 1; n <= 16; n++) {
+    mFixedKey2.encryptECBBlocks(in, n, ref);
+    mFixedKeyNI2.encryptECBBlocks(in, n, out);
+    for (size_t i = 0; i < n; i++) {
+      if (neq(ref[i], out[i])) {
+        std::cout << "AES-NI ECB mismatch\n";
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+int testEvalFullBFS() {
+  for (size_t N : {7, 9, 10, 16, 21}) {
+    const DPF::Key key(DPF::Gen(((1ULL << N) * 5) / 7, N).first);
+    auto ref = N >= 10 ? DPF::EvalFull8(key, N)
+                       : DPF::EvalFull(key, N);
+    if (DPF::EvalFullBFS(key, N) != ref) {
+      std::cout << "EvalFullBFS mismatch at logN " << N << "\n";
+      return -1;
+    }
+    std::vector<uint8_t> reused(DPF::EvalFullSize(N), 0xff);
+    DPF::EvalFullInto(key, N, reused);
+    if (reused != ref) {
+      std::cout << "EvalFullInto mismatch at logN " << N << "\n";
+      return -1;
+    }
+    for (size_t threads : {1, 3, 4, 8}) {
+      if (DPF::EvalFullParallel(key, N, threads) != ref) {
+        std::cout << "EvalFullParallel mismatch at logN " << N << " with "
+                  << threads << " threads\n";
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+int testEvalFullBatch() {
+  for (size_t N : {7, 12, 20}) {
+    std::vector<std::vector<uint8_t>> keys, outputs;
+    for (size_t i = 0; i < 11; i++) {
+      auto kp = DPF::Gen((i * 7919) % (1ULL << N), N);
+      keys.push_back(i % 2 ? kp.first : kp.second);
+    }
+    DPF::EvalFullBatch(keys, N, outputs);
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (outputs[i] != DPF::EvalFullBFS(DPF::Key(keys[i]), N)) {
+        std::cout << "EvalFullBatch mismatch at logN " << N << " key " << i
+                  << "\n";
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+// The AES-NI and VAES kernels must agree, including batches whose key
+// boundaries fall inside a 4-seed vector.
+int testVAES() {
+  if (!DPF::HasVAES())
+    return 0;
+  for (size_t N : {7, 12, 20}) {
+    std::vector<std::vector<uint8_t>> keys, vaes, ni;
+    for (size_t i = 0; i < 5; i++)
+      keys.push_back(DPF::Gen((i * 104729) % (1ULL << N), N).first);
+    const DPF::Key first(keys[0]);
+    auto full = DPF::EvalFullBFS(first, N);
+    DPF::EvalFullBatch(keys, N, vaes);
+    DPF::SetVAES(false);
+    auto full_ni = DPF::EvalFullBFS(first, N);
+    DPF::EvalFullBatch(keys, N, ni);
+    DPF::SetVAES(true);
+    if (full != full_ni || vaes != ni) {
+      std::cout << "VAES mismatch at logN " << N << "\n";
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int testEvalRange() {
+  size_t N = 18;
+  const DPF::Key key(DPF::Gen(77777, N).second);
+  auto full = DPF::EvalFull8(key, N);
+  std::vector<std::pair<size_t, size_t>> ranges = {
+      {0, 1ULL << N}, {0, 8}, {8, 136}, {128, 256}, {77000, 78000},
+      {1000, 200000}, {(1ULL << N) - 24, 1ULL << N}, {4096, 4096}};
+  // uneven shards, as for a non-power-of-two DPU count
+  size_t shards = 100, per = ((1ULL << N) / shards + 7) / 8 * 8;
+  for (size_t i = 0; i * per < (1ULL << N); i++)
+    ranges.push_back({i * per, std::min<size_t>((i + 1) * per, 1ULL << N)});
+  for (const auto &r : ranges) {
+    auto part = DPF::EvalRange(key, N, r.first, r.second);
+    if (!std::equal(part.begin(), part.end(), full.begin() + r.first / 8) ||
+        part.size() != (r.second - r.first) / 8) {
+      std::cout << "EvalRange mismatch for [" << r.first << ", " << r.second
+                << ")\n";
+      return -1;
+    }
+  }
+  // a truncated domain that ends mid-byte, sharded as pim_bench shards it:
+  // the last shard ends on the byte holding the last record
+  const size_t domain = 100003, end = (domain + 7) / 8 * 8;
+  const DPF::Key cut(
+      DPF::Gen(domain - 1, N, 0, DPF::Scheme::GGM, domain).first);
+  auto cut_full = DPF::EvalFull(cut, N);
+  std::vector<uint8_t> joined;
+  for (size_t i = 0; i * per < end; i++) {
+    auto part = DPF::EvalRange(cut, N, i * per, std::min((i + 1) * per, end));
+    joined.insert(joined.end(), part.begin(), part.end());
+  }
+  if (joined != cut_full) {
+    std::cout << "EvalRange shards of a truncated domain mismatch\n";
+    return -1;
+  }
+  return 0;
+}
+
+// The two servers' bitmaps must XOR to the unit vector at alpha, and every
+// evaluator must agree with the reference EvalFull.
+static int checkKeyPair(
+    const std::pair<std::vector<uint8_t>, std::vector<uint8_t>> &keys,
+    size_t alpha, size_t N) {
+  const DPF::Key ka(keys.first), kb(keys.second);
+  auto a = DPF::EvalFull(ka, N);
+  auto b = DPF::EvalFull(kb, N);
+  for (size_t i = 0; i < a.size(); i++) {
+    uint8_t expect = i == alpha / 8 ? (uint8_t)(1U << (alpha % 8)) : 0;
+    if ((a[i] ^ b[i]) != expect) {
+      std::cout << "two-server reconstruction wrong at logN " << N << "\n";
+      return -1;
+    }
+  }
+  for (size_t x : {(size_t)0, alpha - 1, alpha, alpha + 1}) {
+    bool bit = (a[x / 8] >> (x % 8)) & 1;
+    if (DPF::Eval(ka, x, N) != bit) {
+      std::cout << "Eval disagrees with EvalFull at logN " << N << "\n";
+      return -1;
+    }
+  }
+  std::vector<std::vector<uint8_t>> batch_keys = {keys.first, keys.second},
+                                    batch;
+  DPF::EvalFullBatch(batch_keys, N, batch);
+  auto range = DPF::EvalRange(ka, N, 8, (1ULL << N) - 64);
+  DPF::SetVAES(false);
+  auto bfs_ni = DPF::EvalFullBFS(ka, N);
+  DPF::SetVAES(true);
+  if (DPF::EvalFull8(ka, N) != a ||
+      DPF::EvalFullBFS(ka, N) != a || bfs_ni != a ||
+      DPF::EvalFullParallel(ka, N, 3) != a || batch[0] != a ||
+      batch[1] != b || !std::equal(range.begin(), range.end(), a.begin() + 1)) {
+    std::cout << "evaluators disagree at logN " << N << "\n";
+    return -1;
+  }
+  return 0;
+}
+
+int testLeafPacking() {
+  for (size_t N : {13, 16, 20}) {
+    for (size_t leaf_log : {1, 2, 3}) {
+      size_t alpha = ((1ULL << N) * 3) / 11;
+      auto keys = DPF::Gen(alpha, N, leaf_log);
+      if (DPF::KeyLeafLog(DPF::Key(keys.first)) != leaf_log) {
+        std::cout << "leaf packing not recorded in key\n";
+        return -1;
+      }
+      if (checkKeyPair(keys, alpha, N)) {
+        std::cout << "with leaf packing " << leaf_log << "\n";
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+int testHalfTree() {
+  for (size_t N : {7, 10, 13, 20}) {
+    for (size_t leaf_log : {0, 1, 3}) {
+      size_t alpha = ((1ULL << N) * 5) / 13;
+      auto keys = DPF::Gen(alpha, N, leaf_log, DPF::Scheme::HalfTree);
+      if (DPF::KeyScheme(DPF::Key(keys.first)) != DPF::Scheme::HalfTree ||
+          DPF::KeyScheme(DPF::Key(DPF::Gen(alpha, N).first)) !=
+              DPF::Scheme::GGM) {
+        std::cout << "scheme not recorded in key\n";
+        return -1;
+      }
+      if (checkKeyPair(keys, alpha, N)) {
+        std::cout << "with half-tree keys, leaf packing " << leaf_log << "\n";
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+// 4-ary keys: an odd tree depth is folded into the leaf packing.
+int testQuadTree() {
+  for (size_t N : {7, 8, 11, 14, 20}) {
+    for (size_t leaf_log : {0, 1, 3}) {
+      size_t alpha = ((1ULL << N) * 4) / 7;
+      auto keys = DPF::Gen(alpha, N, leaf_log, DPF::Scheme::GGM4);
+      DPF::Key key(keys.first);
+      if (key.scheme != DPF::Scheme::GGM4 || key.depth % 2 ||
+          (size_t)(key.depth + 7 + key.leaf_log) != N ||
+          key.Serialize() != keys.first) {
+        std::cout << "4-ary key malformed at logN " << N << "\n";
+        return -1;
+      }
+      if (checkKeyPair(keys, alpha, N)) {
+        std::cout << "with 4-ary keys, leaf packing " << leaf_log << "\n";
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+// A parsed key must serialise back to the same wire bytes and evaluate to
+// the same bitmap as the byte vector it came from.
+int testKeyFormat() {
+  size_t N = 16, alpha = 12345;
+  for (auto scheme :
+       {DPF::Scheme::GGM, DPF::Scheme::HalfTree, DPF::Scheme::GGM4}) {
+    for (size_t leaf_log : {0, 3}) {
+      auto wire = DPF::Gen(alpha, N, leaf_log, scheme).first;
+      DPF::Key key(wire);
+      std::vector<uint8_t> buf(key.WireSize() + 4, 0xAA);
+      key.Serialize(span<uint8_t>(buf.data() + 2, key.WireSize()));
+      if (key.Serialize() != wire || key.depth != N - 7 - key.leaf_log ||
+          !std::equal(wire.begin(), wire.end(), buf.begin() + 2) ||
+          buf[1] != 0xAA || buf[wire.size() + 2] != 0xAA) {
+        std::cout << "key serialisation does not round-trip\n";
+        return -1;
+      }
+      const DPF::Key copy(key.Serialize());
+      if (DPF::EvalFullBFS(key, N) != DPF::EvalFullBFS(copy, N) ||
+          DPF::Eval(key, alpha, N) != DPF::Eval(copy, alpha, N)) {
+        std::cout << "parsed key evaluates differently\n";
+        return -1;
+      }
+      // a truncated key, an unknown format, a key missing part of a level
+      // (for GGM4, one of a pair), a zero domain or a domain wider than
+      // the tree must be rejected
+      std::vector<std::vector<uint8_t>> bad = {
+          {}, std::vector<uint8_t>(wire.begin(), wire.begin() + 20), wire,
+          wire, wire, wire};
+      bad[2][0] |= 0x08;
+      bad[3].erase(bad[3].begin() + 18, bad[3].begin() + 52);
+      bad[4][0] |= 0x04;
+      bad[4].insert(bad[4].begin() + 1, 8, 0);
+      const uint64_t huge = 1ULL << 60;
+      bad[5][0] |= 0x04;
+      bad[5].insert(bad[5].begin() + 1, (const uint8_t *)&huge,
+                    (const uint8_t *)&huge + 8);
+      for (const auto &b : bad) {
+        try {
+          DPF::Key k(b);
+          std::cout << "malformed key accepted\n";
+          return -1;
+        } catch (const std::invalid_argument &) {
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+int testEvalPoints() {
+  for (auto scheme :
+       {DPF::Scheme::GGM, DPF::Scheme::HalfTree, DPF::Scheme::GGM4}) {
+    for (size_t N : {7, 12, 20}) {
+      for (size_t leaf_log : {0, 2}) {
+        size_t alpha = ((1ULL << N) * 7) / 9;
+        auto keys = DPF::Gen(alpha, N, leaf_log, scheme);
+        // sorted, with repeats, neighbours of alpha and the domain ends
+        std::vector<size_t> xs = {0, 1, alpha - 1, alpha, alpha, alpha + 1,
+                                  (1ULL << N) - 1};
+        for (size_t i = 0; i < 40; i++)
+          xs.push_back((i * 2654435761ULL) % (1ULL << N));
+        std::sort(xs.begin(), xs.end());
+        for (const auto &wire : {keys.first, keys.second}) {
+          const DPF::Key key(wire);
+          auto bits = DPF::EvalPoints(key, xs, N);
+          for (size_t i = 0; i < xs.size(); i++) {
+            if (bits[i] != DPF::Eval(key, xs[i], N)) {
+              std::cout << "EvalPoints disagrees with Eval at logN " << N
+                        << "\n";
+              return -1;
+            }
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+// Domains that are not a power of two: every evaluator returns exactly the
+// domain's bytes with the bits past it clear, and the scans stop at the
+// last record.
+int testDomain() {
+  for (auto scheme :
+       {DPF::Scheme::GGM, DPF::Scheme::HalfTree, DPF::Scheme::GGM4}) {
+    for (size_t leaf_log : {0, 2}) {
+      for (size_t domain : {100, 1000, 12345, 700001}) {
+        size_t N = 0;
+        while ((1ULL << N) < domain)
+          N++;
+        size_t alpha = domain - 1 - domain / 7;
+        auto keys = DPF::Gen(alpha, N, leaf_log, scheme, domain);
+        DPF::Key key(keys.first);
+        const size_t bytes = (domain + 7) / 8;
+        if (key.domain != domain || key.Serialize() != keys.first ||
+            DPF::EvalFullSize(key, N) != bytes) {
+          std::cout << "domain not recorded in key\n";
+          return -1;
+        }
+        auto a = DPF::EvalFull(key, N);
+        auto b = DPF::EvalFull(DPF::Key(keys.second), N);
+        for (size_t i = 0; i < bytes; i++) {
+          uint8_t expect = i == alpha / 8 ? (uint8_t)(1U << (alpha % 8)) : 0;
+          if (a.size() != bytes || (a[i] ^ b[i]) != expect ||
+              (domain % 8 && (a[bytes - 1] >> (domain % 8)))) {
+            std::cout << "truncated EvalFull wrong for domain " << domain
+                      << "\n";
+            return -1;
+          }
+        }
+        std::vector<std::vector<uint8_t>> batch_keys = {keys.first,
+                                                        keys.second},
+                                          batch;
+        DPF::EvalFullBatch(batch_keys, N, batch);
+        std::vector<uint8_t> tiles(bytes);
+        DPF::EvalFullTiles(key, N, 64,
+                           [&](size_t off, const uint8_t *tile, size_t len) {
+                             std::copy(tile, tile + len, tiles.begin() + off);
+                           });
+        auto range = DPF::EvalRange(key, N, 0, (domain + 7) / 8 * 8);
+        if (DPF::EvalFull8(key, N) != a || DPF::EvalFullBFS(key, N) != a ||
+            DPF::EvalFullParallel(key, N, 3) != a || batch[0] != a ||
+            batch[1] != b || tiles != a || range != a ||
+            DPF::Eval(key, domain - 1, N) !=
+                ((a[bytes - 1] >> ((domain - 1) % 8)) & 1)) {
+          std::cout << "evaluators disagree for domain " << domain << "\n";
+          return -1;
+        }
+      }
+    }
+  }
+
+  const size_t records = 100003, N = 17, alpha = records - 2;
+  datastore store;
+  fill_store(store, records);
+  auto keys = DPF::Gen(alpha, N, 0, DPF::Scheme::GGM, records);
+  datastore::db_record answer =
+      _mm256_xor_si256(
+          store.answer_pir(DPF::EvalFullBFS(DPF::Key(keys.first), N)),
+          store.answer_pir(DPF::EvalFullBFS(DPF::Key(keys.second), N)));
+  datastore::db_record fused =
+      _mm256_xor_si256(store.answer_dpf(keys.first, N),
+                       store.answer_dpf(keys.second, N));
+  if (_mm256_extract_epi64(answer, 0) != (int64_t)alpha ||
+      _mm256_extract_epi64(fused, 0) != (int64_t)alpha) {
+    std::cout << "PIR answer wrong for " << records << " records\n";
+    return -1;
+  }
+  return 0;
+}
+
+int testEvalFullT() {
+  for (auto scheme : {DPF::Scheme::GGM, DPF::Scheme::HalfTree}) {
+    for (size_t N : {16, 20, 24}) {
+      for (size_t leaf_log : {0, 1, 2, 3}) {
+        const DPF::Key key(
+            DPF::Gen((1ULL << N) / 3, N, leaf_log, scheme).first);
+        std::vector<uint8_t> out(DPF::EvalFullSize(N));
+        DPF::EvalFullTInto(key, N, out);
+        if (out != DPF::EvalFullBFS(key, N)) {
+          std::cout << "EvalFullT disagrees with EvalFullBFS at logN " << N
+                    << "\n";
+          return -1;
+        }
+      }
+    }
+  }
+  // GGM4 and truncated keys take the generic path; a key for another logn
+  // is refused rather than expanded as the wrong tree
+  const DPF::Key quad(DPF::Gen(12345, 20, 0, DPF::Scheme::GGM4).first);
+  const DPF::Key cut(DPF::Gen(12345, 20, 0, DPF::Scheme::GGM, 99999).first);
+  for (const DPF::Key *key : {&quad, &cut}) {
+    std::vector<uint8_t> out(DPF::EvalFullSize(*key, 20));
+    DPF::EvalFullT<20>(*key, out);
+    if (out != DPF::EvalFullBFS(*key, 20)) {
+      std::cout << "EvalFullT wrong for a GGM4 or truncated key\n";
+      return -1;
+    }
+  }
+  try {
+    std::vector<uint8_t> out(DPF::EvalFullSize(24));
+    DPF::EvalFullT<24>(quad, out);
+    std::cout << "EvalFullT accepted a key for another logN\n";
+    return -1;
+  } catch (const std::invalid_argument &) {
+  }
+  return 0;
+}
+
+int testExpander() {
+  for (auto scheme :
+       {DPF::Scheme::GGM, DPF::Scheme::HalfTree, DPF::Scheme::GGM4}) {
+    for (size_t N : {5, 12, 18}) {
+      for (size_t domain : {(size_t)0, ((size_t)1 << N) - 13}) {
+        const DPF::Key key(DPF::Gen(domain / 2, N, 3, scheme, domain).first);
+        auto expect = DPF::EvalFullBFS(key, N);
+        for (size_t chunk : {1, 1000, 1 << 20}) {
+          DPF::Expander ex(key, N, 256);
+          std::vector<uint8_t> got, buf(chunk);
+          while (!ex.Done()) {
+            size_t n = ex.NextChunk(buf);
+            if (n == 0 || (n < chunk && !ex.Done()))
+              break;
+            got.insert(got.end(), buf.begin(), buf.begin() + n);
+          }
+          if (got != expect || ex.NextChunk(buf) != 0) {
+            std::cout << "Expander output wrong at logN " << N << "\n";
+            return -1;
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+int testGenBatch() {
+  // Gen and GenBatch are seeded per thread unless the test seed is asked for
+  bool fresh = DPF::Gen(5, 12).first != DPF::Gen(5, 12).first;
+  DPF::SetTestSeed(true);
+  bool fixed = DPF::Gen(5, 12).first == DPF::Gen(5, 12).first;
+  const std::vector<size_t> points(20, 5);
+  fixed &= DPF::GenBatch(points, 12, 0, DPF::Scheme::GGM, 0, 3) ==
+           DPF::GenBatch(points, 12, 0, DPF::Scheme::GGM, 0, 1);
+  DPF::SetTestSeed(false);
+  fresh &= DPF::GenBatch(points, 12)[0] != DPF::GenBatch(points, 12)[0];
+  if (!fresh || !fixed) {
+    std::cout << "Gen seeding wrong\n";
+    return -1;
+  }
+  for (auto scheme : {DPF::Scheme::GGM, DPF::Scheme::HalfTree}) {
+    for (size_t leaf_log : {0, 2}) {
+      size_t N = 14, domain = 10000;
+      std::vector<size_t> alphas;
+      for (size_t i = 0; i < 19; i++)
+        alphas.push_back((i * 7919) % domain);
+      auto keys = DPF::GenBatch(alphas, N, leaf_log, scheme, domain, 3);
+      if (keys.size() != alphas.size() || keys[0].first == keys[1].first) {
+        std::cout << "GenBatch returned the wrong keys\n";
+        return -1;
+      }
+      for (size_t i = 0; i < keys.size(); i++) {
+        auto a = DPF::EvalFullBFS(DPF::Key(keys[i].first), N);
+        auto b = DPF::EvalFullBFS(DPF::Key(keys[i].second), N);
+        for (size_t x = 0; x < a.size(); x++) {
+          uint8_t expect =
+              x == alphas[i] / 8 ? (uint8_t)(1U << (alphas[i] % 8)) : 0;
+          if ((a[x] ^ b[x]) != expect) {
+            std::cout << "GenBatch key " << i << " reconstructs wrongly\n";
+            return -1;
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+int testMultiPoint() {
+  const size_t records = 50001, N = 16;
+  const std::vector<size_t> alphas = {3, 4, 777, 20000, 49999, records - 1};
+  datastore store;
+  fill_store(store, records);
+  for (auto scheme : {DPF::Scheme::GGM, DPF::Scheme::HalfTree}) {
+    std::vector<DPF::Key> a, b;
+    for (const auto &keys : DPF::GenBatch(alphas, N, 1, scheme, records)) {
+      a.emplace_back(keys.first);
+      b.emplace_back(keys.second);
+    }
+    // ordinary keys of either scheme side by side, alongside a GGM4 key
+    // over the whole tree
+    const auto quad = DPF::Gen(records / 2, N, 0, DPF::Scheme::GGM4);
+    a.emplace_back(quad.first);
+    b.emplace_back(quad.second);
+    auto ra = store.answer_dpf_multi(a, N);
+    auto rb = store.answer_dpf_multi(b, N);
+    for (size_t j = 0; j < a.size(); j++) {
+      const size_t alpha = j < alphas.size() ? alphas[j] : records / 2;
+      const datastore::db_record single = store.answer_dpf(a[j], N);
+      if (_mm256_extract_epi64(_mm256_xor_si256(ra[j], rb[j]), 0) !=
+              (int64_t)alpha ||
+          std::memcmp(&single, &ra[j], sizeof(single)) != 0) {
+        std::cout << "multi-key PIR answer wrong\n";
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Every scan of a wide-record store against the records it selects, at
+// a record count that ends mid-group and mid-scan-block.
+template <size_t R> int testWideRecords() {
+  typedef basic_datastore<R> store_t;
+  typedef typename store_t::db_record record;
+  const size_t records = 5003, N = 13;
+  const std::vector<size_t> alphas = {0, 7, 1234, records - 1};
+  store_t store;
+  std::vector<uint64_t> words(R / 8);
+  for (size_t i = 0; i < records; i++) {
+    for (size_t w = 0; w < words.size(); w++)
+      words[w] = i * 0x9e3779b97f4a7c15ULL + w;
+    record r;
+    std::memcpy(&r, words.data(), R);
+    store.push_back(r);
+  }
+  auto is = [&](const record &got, size_t i) {
+    for (size_t w = 0; w < words.size(); w++)
+      words[w] = i * 0x9e3779b97f4a7c15ULL + w;
+    return std::memcmp(&got, words.data(), R) == 0;
+  };
+  auto xor_of = [](const record &a, const record &b) {
+    record r;
+    for (size_t l = 0; l < R / 32; l++)
+      ((__m256i *)&r)[l] =
+          _mm256_xor_si256(((const __m256i *)&a)[l], ((const __m256i *)&b)[l]);
+    return r;
+  };
+
+  std::vector<std::vector<uint8_t>> bitmaps;
+  for (size_t alpha : alphas) {
+    auto keys = DPF::Gen(alpha, N, 0, DPF::Scheme::GGM, records);
+    bitmaps.push_back(DPF::EvalFull(DPF::Key(keys.first), N));
+    bitmaps.push_back(DPF::EvalFull(DPF::Key(keys.second), N));
+    if (!is(xor_of(store.answer_pir(bitmaps.end()[-2]),
+                   store.answer_pir(bitmaps.back())), alpha) ||
+        !is(xor_of(store.answer_dpf(keys.first, N),
+                   store.answer_dpf(keys.second, N)), alpha)) {
+      std::cout << R << "-byte PIR answer wrong\n";
+      return -1;
+    }
+  }
+  for (size_t n : {(size_t)5, (size_t)1001, records}) {
+    const record serial = store.answer_pir(bitmaps[0], n);
+    store_t::SetAVX512(false);
+    const record avx2 = store.answer_pir(bitmaps[0], n);
+    store_t::SetAVX512(true);
+    if (std::memcmp(&serial, &avx2, R) != 0) {
+      std::cout << R << "-byte AVX-512 scan disagrees with AVX2\n";
+      return -1;
+    }
+    for (size_t threads : {1, 3}) {
+      const record parallel = store.answer_pir_parallel(bitmaps[0], n, threads);
+      if (std::memcmp(&serial, &parallel, R) != 0) {
+        std::cout << R << "-byte parallel PIR scan wrong\n";
+        return -1;
+      }
+    }
+  }
+  typename store_t::aligned_vector answers, table;
+  store.answer_pir_batch_tiled(bitmaps, answers, 2);
+  store.answer_pir_batch_table(bitmaps, table, 2);
+  for (size_t j = 0; j < bitmaps.size(); j++) {
+    const record single = store.answer_pir(bitmaps[j]);
+    if (std::memcmp(&answers[j], &single, R) != 0 ||
+        std::memcmp(&table[j], &single, R) != 0) {
+      std::cout << R << "-byte batch PIR answer " << j << " wrong\n";
+      return -1;
+    }
+  }
+  std::vector<DPF::Key> ka, kb;
+  for (const auto &keys :
+       DPF::GenBatch(alphas, N, 0, DPF::Scheme::GGM, records)) {
+    ka.emplace_back(keys.first);
+    kb.emplace_back(keys.second);
+  }
+  auto ra = store.answer_dpf_multi(ka, N);
+  auto rb = store.answer_dpf_multi(kb, N);
+  for (size_t j = 0; j < alphas.size(); j++) {
+    if (!is(xor_of(ra[j], rb[j]), alphas[j])) {
+      std::cout << R << "-byte multi-key PIR answer wrong\n";
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// A saved store served from its mapping answers as the in-memory one did,
+// with every open_mmap flag; a file of another width, cut short or with
+// a corrupt record count is refused.
+int testMmap() {
+  const std::string path = "/tmp/dpfpir_test_" + std::to_string(getpid());
+  datastore store;
+  fill_store(store, 70001);
+  store.save(path);
+  auto keys = DPF::Gen(4321, 17, 0, DPF::Scheme::GGM, store.size());
+  std::vector<uint8_t> bits = DPF::EvalFull(DPF::Key(keys.first), 17);
+  for (unsigned flags : {0U, (unsigned)datastore::kMapPopulate,
+                         (unsigned)(datastore::kMapPopulate |
+                                    datastore::kMapHugePages)}) {
+    const datastore mapped = datastore::open_mmap(path, flags);
+    if (!mapped.mapped() || mapped.size() != store.size() ||
+        !_mm256_testz_si256(_mm256_xor_si256(mapped.answer_pir(bits),
+                                             store.answer_pir(bits)),
+                            _mm256_set1_epi64x(-1)) ||
+        !_mm256_testz_si256(_mm256_xor_si256(mapped.answer_dpf(keys.first, 17),
+                                             store.answer_pir(bits)),
+                            _mm256_set1_epi64x(-1))) {
+      std::cout << "mapped database answers wrong, flags " << flags << "\n";
+      std::remove(path.c_str());
+      return -1;
+    }
+  }
+  int res = 0;
+  try {
+    basic_datastore<64>::open_mmap(path);
+    std::cout << "mapped database opened with the wrong record width\n";
+    res = -1;
+  } catch (const std::runtime_error &) {
+  }
+  if (truncate(path.c_str(), 4096 + 32 * 1000) != 0)
+    res = -1;
+  try {
+    datastore::open_mmap(path);
+    std::cout << "truncated database opened\n";
+    res = -1;
+  } catch (const std::runtime_error &) {
+  }
+  // a count whose byte length wraps to zero
+  const uint64_t count = 1ULL << 59;
+  const int fd = open(path.c_str(), O_WRONLY);
+  if (fd < 0 || pwrite(fd, &count, sizeof(count),
+                       offsetof(datastore_file_header, count)) !=
+                    (ssize_t)sizeof(count))
+    res = -1;
+  close(fd);
+  try {
+    datastore::open_mmap(path);
+    std::cout << "database with an overflowing count opened\n";
+    res = -1;
+  } catch (const std::runtime_error &) {
+  }
+  std::remove(path.c_str());
+  return res;
+}
+
+// Stores and bitmaps on huge pages (hugetlbfs pool or THP, whichever the
+// machine offers) answer as the heap-backed ones do; allocations small
+// and large, of either page size, come back aligned and usable.
+template <typename Pages> int testHugePagesWith() {
+  typedef basic_datastore<32, Pages> huge_store;
+  for (size_t bytes : {(size_t)100, (size_t)3 << 20}) {
+    std::vector<uint8_t, AlignmentAllocator<uint8_t, 64, Pages>> v(bytes, 7);
+    if ((uintptr_t)v.data() % 64 != 0 || v[bytes - 1] != 7) {
+      std::cout << "huge-page allocation of " << bytes << " bytes broken\n";
+      return -1;
+    }
+  }
+  const size_t records = 70001, N = 17;
+  datastore store;
+  huge_store huge;
+  fill_store(store, records);
+  fill_store(huge, records);
+  auto keys = DPF::Gen(60000, N, 0, DPF::Scheme::GGM, records);
+  const DPF::Key key(keys.first);
+  typename huge_store::bitmap_vector bits(DPF::EvalFullSize(key, N));
+  DPF::EvalFullInto(key, N, span<uint8_t>(bits.data(), bits.size()));
+  const datastore::db_record want = store.answer_pir(DPF::EvalFull(key, N));
+  if (!_mm256_testz_si256(_mm256_xor_si256(huge.answer_pir(bits), want),
+                          _mm256_set1_epi64x(-1)) ||
+      !_mm256_testz_si256(
+          _mm256_xor_si256(huge.answer_pir_parallel(bits, records, 2), want),
+          _mm256_set1_epi64x(-1))) {
+    std::cout << "huge-page store answers wrong\n";
+    return -1;
+  }
+  return 0;
+}
+
+int testHugePages() {
+  return testHugePagesWith<HugePages<>>() |
+         testHugePagesWith<HugePages<1ULL << 30>>();
 }
 
 #ifdef ENABLE_PIM
 #include <dpu>
 using namespace dpu;
-#define BINARY_NAME "dpu_task"
+// the kernel variant built for datastore's record width
+static const std::string BINARY_NAME =
+    "dpu_task_" + std::to_string(sizeof(datastore::db_record));
 void setup(size_t NUM_ELEM,size_t NUM_DPUS, dpu::DpuSet **dpu_set, std::vector<dpu_args_t> &args) {
   try {
 
@@ -45,6 +852,7 @@ void setup(size_t NUM_ELEM,size_t NUM_DPUS, dpu::DpuSet **dpu_set, std::vector<d
     size_t database_size_per_dpu_bytes = data_per_dpu * sizeof(datastore::db_record);
     args[0].database_size_bytes = database_size_per_dpu_bytes;
     args[0].num_batches = 1;
+    args[0].record_bytes = sizeof(datastore::db_record);
 
     std::vector<std::vector<uint64_t>> dpu_store(NUM_DPUS);
 
@@ -108,8 +916,8 @@ int testPIM() {
   auto keys = DPF::Gen(5, N);
   auto a = keys.first;
   auto b = keys.second;
-  std::vector<uint8_t> aaaa = DPF::EvalFull8(a, N);
-  std::vector<uint8_t> bbbb = DPF::EvalFull8(b, N);
+  std::vector<uint8_t> aaaa = DPF::EvalFull8(DPF::Key(a), N);
+  std::vector<uint8_t> bbbb = DPF::EvalFull8(DPF::Key(b), N);
 
   datastore::db_record answerA = execution_pim(N, aaaa, num_dpus, dpu_set, args);
   datastore::db_record answerB = execution_pim(N, bbbb, num_dpus, dpu_set, args);
@@ -126,7 +934,27 @@ int testPIM() {
 
 int main(int argc, char **argv) {
   int res = 0;
+  res |= testAESNI();
+  res |= testEvalFullBFS();
+  res |= testEvalFullBatch();
+  res |= testVAES();
+  res |= testEvalRange();
+  res |= testLeafPacking();
+  res |= testHalfTree();
+  res |= testQuadTree();
+  res |= testKeyFormat();
+  res |= testEvalPoints();
+  res |= testDomain();
+  res |= testEvalFullT();
+  res |= testExpander();
+  res |= testGenBatch();
+  res |= testMultiPoint();
   res |= testCPU();
+  res |= testWideRecords<64>();
+  res |= testWideRecords<256>();
+  res |= testWideRecords<1024>();
+  res |= testMmap();
+  res |= testHugePages();
 #ifdef ENABLE_PIM
   res |= testPIM();
 #endif
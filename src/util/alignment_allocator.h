@@ -2,6 +2,7 @@
 #define ALIGNMENT_ALLOCATOR_H
 
 #include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <new>
 
@@ -10,8 +11,104 @@
 #elif defined(_MSC_VER)
   #include <malloc.h>       // MSVC: _aligned_malloc / _aligned_free
 #endif
+#if defined(__linux__)
+  #include <sys/mman.h>
+#endif
+
+// Page policies: where AlignmentAllocator gets its memory. allocate
+// returns nullptr on failure; deallocate is given the same byte count.
+
+// The aligned heap, on the system's base pages.
+struct DefaultPages {
+  static void* allocate(std::size_t bytes, std::size_t alignment) {
+    void* ptr = nullptr;
+  #if defined(__GNUC__) || defined(__clang__)
+    ptr = _mm_malloc(bytes, alignment);
+  #elif defined(_MSC_VER)
+    ptr = _aligned_malloc(bytes, alignment);
+  #else
+    // fallback to posix_memalign
+    if (posix_memalign(&ptr, alignment, bytes) != 0)
+      ptr = nullptr;
+  #endif
+    return ptr;
+  }
+
+  static void deallocate(void* p, std::size_t) {
+  #if defined(__GNUC__) || defined(__clang__)
+    _mm_free(p);
+  #elif defined(_MSC_VER)
+    _aligned_free(p);
+  #else
+    free(p);
+  #endif
+  }
+};
+
+// Huge pages for allocations of 2 MiB and up, so a scan over a large
+// vector takes a TLB miss per PageBytes rather than per 4 KiB. Tried in
+// order: pages of PageBytes (2 MiB or 1 GiB) from the hugetlbfs pool,
+// which exist only once reserved through /proc/sys/vm/nr_hugepages (or
+// hugepages=); then an anonymous 2 MiB-aligned mapping advised
+// MADV_HUGEPAGE, which the kernel backs with transparent huge pages
+// unless THP is disabled. Each such allocation spans whole PageBytes of
+// address space. Smaller allocations, and non-Linux builds, use
+// DefaultPages.
+template <std::size_t PageBytes = std::size_t(1) << 21>
+struct HugePages {
+  static_assert(PageBytes == (std::size_t(1) << 21) ||
+                PageBytes == (std::size_t(1) << 30),
+                "huge pages are 2 MiB or 1 GiB");
+  static const std::size_t kMinBytes = std::size_t(1) << 21;
+
+  static void* allocate(std::size_t bytes, std::size_t alignment) {
+  #if defined(__linux__)
+    if (bytes >= kMinBytes) {
+      const std::size_t len = length(bytes);
+      const int page_log = PageBytes == kMinBytes ? 21 : 30;
+      void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                         (page_log << MAP_HUGE_SHIFT),
+                     -1, 0);
+      if (p != MAP_FAILED)
+        return p;
+      // no pool: over-map by 2 MiB and trim to a 2 MiB-aligned run, so
+      // THP can use huge pages from the first byte
+      char* raw = static_cast<char*>(mmap(nullptr, len + kMinBytes,
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+      if (raw == MAP_FAILED)
+        return nullptr;
+      char* q = reinterpret_cast<char*>(
+          (reinterpret_cast<std::uintptr_t>(raw) + kMinBytes - 1) &
+          ~static_cast<std::uintptr_t>(kMinBytes - 1));
+      if (q > raw)
+        munmap(raw, q - raw);
+      munmap(q + len, raw + kMinBytes - q);
+      madvise(q, len, MADV_HUGEPAGE);
+      return q;
+    }
+  #endif
+    return DefaultPages::allocate(bytes, alignment);
+  }
+
+  static void deallocate(void* p, std::size_t bytes) {
+  #if defined(__linux__)
+    if (bytes >= kMinBytes) {
+      munmap(p, length(bytes));
+      return;
+    }
+  #endif
+    DefaultPages::deallocate(p, bytes);
+  }
 
-template <typename T, std::size_t Alignment = 32>
+private:
+  static std::size_t length(std::size_t bytes) {
+    return (bytes + PageBytes - 1) / PageBytes * PageBytes;
+  }
+};
+
+template <typename T, std::size_t Alignment = 32, typename Pages = DefaultPages>
 class AlignmentAllocator {
 public:
   using value_type      = T;
@@ -23,38 +120,22 @@ public:
   using const_reference = const T&;
 
   template <typename U>
-  struct rebind { using other = AlignmentAllocator<U, Alignment>; };
+  struct rebind { using other = AlignmentAllocator<U, Alignment, Pages>; };
 
   AlignmentAllocator() noexcept {}
   template <typename U>
-  AlignmentAllocator(const AlignmentAllocator<U, Alignment>&) noexcept {}
+  AlignmentAllocator(const AlignmentAllocator<U, Alignment, Pages>&) noexcept {}
 
   pointer allocate(size_type n) {
     if (n == 0) return nullptr;
-    void* ptr = nullptr;
-  #if defined(__GNUC__) || defined(__clang__)
-    ptr = _mm_malloc(n * sizeof(value_type), Alignment);
-    if (!ptr) throw std::bad_alloc();
-  #elif defined(_MSC_VER)
-    ptr = _aligned_malloc(n * sizeof(value_type), Alignment);
+    void* ptr = Pages::allocate(n * sizeof(value_type), Alignment);
     if (!ptr) throw std::bad_alloc();
-  #else
-    // fallback to posix_memalign
-    if (posix_memalign(&ptr, Alignment, n * sizeof(value_type)) != 0)
-      throw std::bad_alloc();
-  #endif
     return static_cast<pointer>(ptr);
   }
 
-  void deallocate(pointer p, size_type) noexcept {
+  void deallocate(pointer p, size_type n) noexcept {
     if (!p) return;
-  #if defined(__GNUC__) || defined(__clang__)
-    _mm_free(p);
-  #elif defined(_MSC_VER)
-    _aligned_free(p);
-  #else
-    free(p);
-  #endif
+    Pages::deallocate(p, n * sizeof(value_type));
   }
 
   // construction/destruction
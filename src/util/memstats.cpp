@@ -0,0 +1,35 @@
+#include "memstats.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <sys/resource.h>
+
+static std::atomic<size_t> g_allocations{0};
+static std::atomic<size_t> g_allocated_bytes{0};
+
+MemStats MemStats::now() {
+  MemStats s;
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  s.minor_faults = usage.ru_minflt;
+  s.major_faults = usage.ru_majflt;
+  s.allocations = g_allocations.load(std::memory_order_relaxed);
+  s.allocated_bytes = g_allocated_bytes.load(std::memory_order_relaxed);
+  return s;
+}
+
+void *operator new(std::size_t n) {
+  g_allocations.fetch_add(1, std::memory_order_relaxed);
+  g_allocated_bytes.fetch_add(n, std::memory_order_relaxed);
+  if (void *p = std::malloc(n ? n : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t n) { return operator new(n); }
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::size_t) noexcept { std::free(p); }
@@ -0,0 +1,38 @@
+#ifndef MEMSTATS_H
+#define MEMSTATS_H
+
+#include <cstddef>
+#include <ostream>
+
+// Process-wide memory counters for the benchmarks. Page faults come from
+// getrusage(); heap allocations are counted by the replacement operator
+// new in memstats.cpp, so only binaries linking that file see non-zero
+// allocation counts.
+struct MemStats {
+  size_t minor_faults = 0;
+  size_t major_faults = 0;
+  size_t allocations = 0;
+  size_t allocated_bytes = 0;
+
+  static MemStats now();
+
+  MemStats operator-(const MemStats &other) const {
+    MemStats d;
+    d.minor_faults = minor_faults - other.minor_faults;
+    d.major_faults = major_faults - other.major_faults;
+    d.allocations = allocations - other.allocations;
+    d.allocated_bytes = allocated_bytes - other.allocated_bytes;
+    return d;
+  }
+
+  // Print the counters averaged over `per` operations.
+  void print(std::ostream &os, size_t per = 1) const {
+    os << "Page faults : " << (double)minor_faults / per << " minor, "
+       << (double)major_faults / per << " major" << std::endl;
+    os << "Allocations : " << (double)allocations / per << " ("
+       << (double)allocated_bytes / per / (1024 * 1024) << " MiB)"
+       << std::endl;
+  }
+};
+
+#endif // MEMSTATS_H